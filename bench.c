@@ -0,0 +1,353 @@
+/* Benchmark driver for queue operations
+ *
+ * Runs each queue operation on queues of geometrically increasing size, for
+ * several distributions of string length and input order, and reports the
+ * time per element together with the exponent b of the least-squares fit
+ * time ~ n^b.  Linear operations give b close to 1, O(n log n) ones slightly
+ * above 1, and quadratic ones close to 2.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+
+#include "queue.h"
+#include "report.h"
+
+#define MIN_SIZE 1000
+#define DEFAULT_MAX_SIZE 1000000
+#define MAX_SIZES 8
+
+/* Small sizes are run repeatedly, keeping the fastest run, so that each
+ * measurement covers at least this many elements.
+ */
+#define MIN_ELEMENTS 100000
+#define MAX_REPEAT 20
+
+/* Longest generated string is 128 characters */
+#define MAXSTR 256
+
+/* Group size passed to q_reverseK */
+#define REVERSE_K 16
+
+/* Number of queues combined by q_merge */
+#define MERGE_WAYS 4
+
+typedef enum { LEN_SHORT, LEN_LONG, LEN_MIXED, N_LENS } len_dist_t;
+static const char *len_names[N_LENS] = {"short", "long", "mixed"};
+
+typedef enum {
+    ORDER_RANDOM,
+    ORDER_SORTED,
+    ORDER_REVERSED,
+    ORDER_NEARLY,
+    N_ORDERS
+} order_t;
+static const char *order_names[N_ORDERS] = {"random", "sorted", "reversed",
+                                            "nearly"};
+
+/* Each operation builds its input from vals[0..n-1], in that order, and
+ * returns the time spent in the operation itself in nanoseconds.
+ */
+typedef uint64_t (*bench_func_t)(char **vals, int n);
+
+typedef struct {
+    char *name;
+    bench_func_t run;
+    bool ordered; /* Does the result depend on input order? */
+} bench_op_t;
+
+static struct list_head *build(char **vals, int n)
+{
+    struct list_head *q = q_new();
+    for (int i = 0; i < n; i++) {
+        if (!q_insert_tail(q, vals[i])) {
+            fprintf(stderr, "Insertion failed at element %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return q;
+}
+
+static uint64_t bench_ih(char **vals, int n)
+{
+    struct list_head *q = q_new();
+    uint64_t start = time_ns();
+    for (int i = 0; i < n; i++)
+        q_insert_head(q, vals[i]);
+    uint64_t elapsed = time_ns() - start;
+    q_free(q);
+    return elapsed;
+}
+
+static uint64_t bench_it(char **vals, int n)
+{
+    struct list_head *q = q_new();
+    uint64_t start = time_ns();
+    for (int i = 0; i < n; i++)
+        q_insert_tail(q, vals[i]);
+    uint64_t elapsed = time_ns() - start;
+    q_free(q);
+    return elapsed;
+}
+
+static uint64_t bench_remove(char **vals, int n, bool tail)
+{
+    char buf[MAXSTR];
+    struct list_head *q = build(vals, n);
+    uint64_t start = time_ns();
+    for (int i = 0; i < n; i++) {
+        element_t *e = tail ? q_remove_tail(q, buf, sizeof(buf))
+                            : q_remove_head(q, buf, sizeof(buf));
+        q_release_element(e);
+    }
+    uint64_t elapsed = time_ns() - start;
+    q_free(q);
+    return elapsed;
+}
+
+static uint64_t bench_rh(char **vals, int n)
+{
+    return bench_remove(vals, n, false);
+}
+
+static uint64_t bench_rt(char **vals, int n)
+{
+    return bench_remove(vals, n, true);
+}
+
+/* Time a function taking only the queue */
+#define BENCH_WHOLE_QUEUE(op, call)                        \
+    static uint64_t bench_##op(char **vals, int n)         \
+    {                                                      \
+        struct list_head *q = build(vals, n);              \
+        uint64_t start = time_ns();                        \
+        call;                                              \
+        uint64_t elapsed = time_ns() - start;              \
+        q_free(q);                                         \
+        return elapsed;                                    \
+    }
+
+BENCH_WHOLE_QUEUE(reverse, q_reverse(q))
+BENCH_WHOLE_QUEUE(reverseK, q_reverseK(q, REVERSE_K))
+BENCH_WHOLE_QUEUE(sort, q_sort(q, false))
+BENCH_WHOLE_QUEUE(ascend, q_ascend(q))
+BENCH_WHOLE_QUEUE(descend, q_descend(q))
+
+/* Every value appears twice in a sorted queue */
+static uint64_t bench_dedup(char **vals, int n)
+{
+    struct list_head *q = q_new();
+    for (int i = 0; i < n; i++)
+        q_insert_tail(q, vals[i / 2]);
+    q_sort(q, false);
+
+    uint64_t start = time_ns();
+    q_delete_dup(q);
+    uint64_t elapsed = time_ns() - start;
+    q_free(q);
+    return elapsed;
+}
+
+/* Merge MERGE_WAYS sorted queues of n / MERGE_WAYS elements each */
+static uint64_t bench_merge(char **vals, int n)
+{
+    LIST_HEAD(chain);
+    queue_contex_t ctx[MERGE_WAYS];
+    int part = n / MERGE_WAYS;
+    for (int i = 0; i < MERGE_WAYS; i++) {
+        ctx[i].q = build(vals + i * part, part);
+        q_sort(ctx[i].q, false);
+        ctx[i].size = part;
+        ctx[i].id = i;
+        list_add_tail(&ctx[i].chain, &chain);
+    }
+
+    uint64_t start = time_ns();
+    q_merge(&chain, false);
+    uint64_t elapsed = time_ns() - start;
+    for (int i = 0; i < MERGE_WAYS; i++)
+        q_free(ctx[i].q);
+    return elapsed;
+}
+
+static bench_op_t ops[] = {
+    {"ih", bench_ih, false},
+    {"it", bench_it, false},
+    {"rh", bench_rh, false},
+    {"rt", bench_rt, false},
+    {"reverse", bench_reverse, false},
+    {"reverseK", bench_reverseK, false},
+    {"sort", bench_sort, true},
+    {"merge", bench_merge, false},
+    {"dedup", bench_dedup, false},
+    {"ascend", bench_ascend, true},
+    {"descend", bench_descend, true},
+};
+
+/* Pool of generated strings, shared by all operations */
+static char **pool;
+
+static void fill_pool(len_dist_t dist, int n)
+{
+    for (int i = 0; i < n; i++) {
+        int len = dist == LEN_SHORT  ? 8
+                  : dist == LEN_LONG ? 128
+                                     : 1 + rand() % 64;
+        char *s = pool[i];
+        for (int j = 0; j < len; j++)
+            s[j] = 'a' + rand() % 26;
+        s[len] = '\0';
+    }
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Copy first n pool entries into vals, arranged in given order */
+static void arrange(char **vals, int n, order_t order)
+{
+    memcpy(vals, pool, n * sizeof(char *));
+    if (order == ORDER_RANDOM)
+        return;
+
+    qsort(vals, n, sizeof(char *), cmp_str);
+    if (order == ORDER_REVERSED) {
+        for (int i = 0, j = n - 1; i < j; i++, j--) {
+            char *t = vals[i];
+            vals[i] = vals[j];
+            vals[j] = t;
+        }
+    } else if (order == ORDER_NEARLY) {
+        /* Swap 1% of elements with a random partner */
+        for (int k = 0; k < n / 100; k++) {
+            int i = rand() % n, j = rand() % n;
+            char *t = vals[i];
+            vals[i] = vals[j];
+            vals[j] = t;
+        }
+    }
+}
+
+/* Least-squares slope of log(time) against log(n) */
+static double scaling_exponent(const int *sizes, const uint64_t *ns, int cnt)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int m = 0;
+    for (int i = 0; i < cnt; i++) {
+        if (!ns[i])
+            continue;
+        double x = log((double) sizes[i]), y = log((double) ns[i]);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        m++;
+    }
+    double den = m * sxx - sx * sx;
+    return m > 1 && den != 0 ? (m * sxy - sx * sy) / den : NAN;
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-h] [-m MAXSIZE] [-o OP]\n", cmd);
+    printf("\t-h          Print this information\n");
+    printf("\t-m MAXSIZE  Largest queue size (default: %d)\n",
+           DEFAULT_MAX_SIZE);
+    printf("\t-o OP       Only run operation OP\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_size = DEFAULT_MAX_SIZE;
+    char *only = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "hm:o:")) != -1) {
+        switch (c) {
+        case 'm':
+            max_size = atoi(optarg);
+            break;
+        case 'o':
+            only = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            break;
+        }
+    }
+
+    int sizes[MAX_SIZES];
+    int n_sizes = 0;
+    for (long n = MIN_SIZE; n <= max_size && n_sizes < MAX_SIZES; n *= 10)
+        sizes[n_sizes++] = n;
+    if (!n_sizes) {
+        fprintf(stderr, "Largest size must be at least %d\n", MIN_SIZE);
+        return 1;
+    }
+    int n_max = sizes[n_sizes - 1];
+
+    /* Skip the linear search of cautious mode on every free */
+    set_cautious_mode(false);
+    srand(1);
+
+    pool = malloc(n_max * sizeof(char *));
+    char *chars = malloc((size_t) n_max * (128 + 1));
+    char **vals = malloc(n_max * sizeof(char *));
+    if (!pool || !chars || !vals) {
+        fprintf(stderr, "Cannot allocate %d strings\n", n_max);
+        return 1;
+    }
+    for (int i = 0; i < n_max; i++)
+        pool[i] = chars + (size_t) i * (128 + 1);
+
+    printf("%-10s%-8s%-10s", "op", "strings", "order");
+    for (int i = 0; i < n_sizes; i++)
+        printf("%10d", sizes[i]);
+    printf("%10s\n", "exponent");
+    printf("%28s(ns per element)\n", "");
+
+    for (len_dist_t d = 0; d < N_LENS; d++) {
+        fill_pool(d, n_max);
+        for (size_t k = 0; k < sizeof(ops) / sizeof(ops[0]); k++) {
+            bench_op_t *op = &ops[k];
+            if (only && strcmp(only, op->name))
+                continue;
+
+            for (order_t o = 0; o < (op->ordered ? N_ORDERS : 1); o++) {
+                uint64_t ns[MAX_SIZES];
+                printf("%-10s%-8s%-10s", op->name, len_names[d],
+                       order_names[o]);
+                fflush(stdout);
+                for (int i = 0; i < n_sizes; i++) {
+                    int reps = MIN_ELEMENTS / sizes[i];
+                    reps = reps < 1 ? 1 : reps > MAX_REPEAT ? MAX_REPEAT : reps;
+                    arrange(vals, sizes[i], o);
+                    ns[i] = UINT64_MAX;
+                    for (int r = 0; r < reps; r++) {
+                        uint64_t t = op->run(vals, sizes[i]);
+                        if (t < ns[i])
+                            ns[i] = t;
+                    }
+                    printf("%10.1f", (double) ns[i] / sizes[i]);
+                    fflush(stdout);
+                }
+                printf("%10.2f\n", scaling_exponent(sizes, ns, n_sizes));
+            }
+        }
+    }
+
+    free(vals);
+    free(chars);
+    free(pool);
+    return 0;
+}
@@ -1,17 +1,22 @@
 /* Implementation of simple command-line interface */
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "console.h"
+#include "perfcount.h"
 #include "report.h"
 #include "web.h"
 
@@ -37,8 +42,10 @@ static double first_time, last_time;
 
 typedef struct __rio {
     int fd;                /* File descriptor */
-    int count;             /* Unread bytes in internal buffer */
+    ssize_t count;         /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
+    char *map;             /* Mapped file contents, or NULL */
+    size_t map_len;        /* Length of mapping */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
     struct __rio *prev;    /* Next element in stack */
 } rio_t;
@@ -46,6 +53,9 @@ typedef struct __rio {
 static rio_t *buf_stack;
 static char linebuf[RIO_BUFSIZE];
 
+/* Was the last line read longer than linebuf? */
+static bool line_cut = false;
+
 /* Maximum file descriptor */
 static int fd_max = 0;
 
@@ -53,11 +63,36 @@ static int fd_max = 0;
 static int err_limit = 5;
 static int err_cnt = 0;
 static int echo = 0;
+static int latency_stats = 0;
+
+/* Optional function describing queue state for machine-readable output */
+static state_func_t state_fun = NULL;
+
+/* Optional function serializing commands run by different threads */
+static cmd_lock_func_t lock_fun = NULL;
+
+/* Does this thread serve web clients, next to the console? */
+static __thread bool web_worker = false;
+
+/* Guards the latency histograms, which web workers record into */
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Held for reading by web workers while they use the command list, and for
+ * writing by quit, which frees it.
+ */
+static pthread_rwlock_t quit_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Commands of the Unix domain socket, in the order of its opcodes */
+static cmd_element_t **unix_ops = NULL;
+static size_t unix_n_ops = 0;
 
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
 static bool has_infile = false;
 
+/* Read commands from a file ahead of running them, in a thread of its own */
+static bool pipelined = false;
+
 /* Optional function to call as part of exit process */
 /* Maximum number of quit functions */
 
@@ -71,6 +106,48 @@ static bool push_file(char *fname);
 static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
+static bool do_repeat(int argc, char *argv[]);
+static bool do_end(int argc, char *argv[]);
+static bool do_time(int argc, char *argv[]);
+static bool do_perf(int argc, char *argv[]);
+static bool do_quit(int argc, char *argv[]);
+static bool do_source(int argc, char *argv[]);
+static bool do_web(int argc, char *argv[]);
+static bool do_unix(int argc, char *argv[]);
+
+/* Commands recorded between 'repeat n' and 'end'.
+ * Each block is a linked list in order of appearance.  An entry without a
+ * command is a nested block.
+ */
+typedef struct __repeat_cmd {
+    cmd_element_t *cmd;
+    int argc;
+    char **argv;
+    int count;                 /* Iterations of a nested block */
+    struct __repeat_cmd *body; /* Commands of a nested block */
+    cmd_func_t wrap;           /* do_time or do_perf around a nested block */
+    struct __repeat_cmd *next;
+} repeat_cmd_t;
+
+#define MAX_REPEAT_DEPTH 16
+
+/* Stack of blocks still being recorded.  Like the rest of the state of
+ * commands in progress, each thread running commands has its own.
+ */
+static __thread struct {
+    repeat_cmd_t *block;
+    repeat_cmd_t **tail;
+} repeat_stack[MAX_REPEAT_DEPTH];
+static __thread int repeat_depth = 0;
+
+/* Is a block being executed?  Is the outermost one timed or profiled? */
+static __thread bool repeat_running = false;
+static __thread bool repeat_timing = false;
+static __thread bool repeat_perf = false;
+
+/* Hardware counters of the 'perf' command in progress */
+static __thread perf_counters_t perf_ctrs;
+static __thread bool perf_active = false;
 
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
@@ -87,6 +164,9 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->latency = NULL;
+    cmd->calls = 0;
+    cmd->failures = 0;
     cmd->next = next_cmd;
     *last_loc = cmd;
 }
@@ -111,24 +191,31 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     *last_loc = param;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
-{
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
+/* Upper bound on words in a command line.  A line never holds more than
+ * RIO_BUFSIZE characters, and each word needs at least one separator.
+ */
+#define MAX_ARGC (RIO_BUFSIZE / 2)
 
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
+/* Scratch space reused by parse_args for every command line, so that
+ * interpreting a command does not touch the heap.
+ */
+static __thread char argbuf[RIO_BUFSIZE];
+static __thread char *argvbuf[MAX_ARGC];
 
+/* Parse a string into a command line.
+ * The words are copied into argbuf with each one null-terminated, and the
+ * returned array points into that buffer.  Both stay valid until the next
+ * call.  Return NULL if the words do not fit.
+ */
+static char **parse_args(char *line, int *argcp)
+{
     char *src = line;
-    char *dst = buf;
+    char *dst = argbuf;
+    char *end = argbuf + RIO_BUFSIZE - 1;
     bool skipping = true;
     int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
+    while ((c = *src++) != '\0' && dst < end) {
         if (isspace(c)) {
             if (!skipping) {
                 /* Hit end of word */
@@ -138,56 +225,212 @@ static char **parse_args(char *line, int *argcp)
         } else {
             if (skipping) {
                 /* Hit start of new word */
-                argc++;
+                if (argc == MAX_ARGC)
+                    break;
+                argvbuf[argc++] = dst;
                 skipping = false;
             }
             *dst++ = c;
         }
     }
+    *dst = '\0';
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
+    /* Only white space may be left over */
+    while (c != '\0' && isspace(c))
+        c = *src++;
+    if (c != '\0')
+        return NULL;
 
-    free_block(buf, len + 1);
     *argcp = argc;
-    return argv;
+    return argvbuf;
 }
 
 static void record_error()
 {
-    err_cnt++;
-    if (err_cnt >= err_limit) {
+    if (__atomic_add_fetch(&err_cnt, 1, __ATOMIC_RELAXED) >= err_limit) {
         report(1, "Error limit exceeded.  Stopping command execution");
         quit_flag = true;
     }
 }
 
+/* Find command by name.  Return NULL if there is none */
+static cmd_element_t *find_cmd(const char *name)
+{
+    cmd_element_t *next_cmd = cmd_list;
+    while (next_cmd && strcmp(name, next_cmd->name) != 0)
+        next_cmd = next_cmd->next;
+    return next_cmd;
+}
+
+/* Run the operation of a command, holding the locks it needs */
+static bool run_cmd(cmd_element_t *cmd, int argc, char *argv[])
+{
+    if (!lock_fun)
+        return cmd->operation(argc, argv);
+
+    /* quit frees the command */
+    cmd_func_t op = cmd->operation;
+    lock_fun(op, true);
+    bool ok = op(argc, argv);
+    lock_fun(op, false);
+    return ok;
+}
+
+/* Invoke a command, recording its latency and result when enabled */
+static bool record_cmd(cmd_element_t *cmd, int argc, char *argv[])
+{
+    bool record_result = resultfile_enabled();
+    if (!latency_stats && !record_result)
+        return run_cmd(cmd, argc, argv);
+
+    long elements = 0, blocks = 0;
+    if (record_result && state_fun)
+        state_fun(&elements, &blocks);
+
+    uint64_t start = time_ns();
+    bool ok = run_cmd(cmd, argc, argv);
+    uint64_t elapsed = time_ns() - start;
+
+    if (record_result) {
+        cmd_result_t res = {
+            .argc = argc,
+            .argv = argv,
+            .elapsed_ns = elapsed,
+            .elements = 0,
+            .alloc_delta = -blocks,
+            .ok = ok,
+        };
+        /* Queues are gone after quit */
+        if (state_fun && !quit_flag)
+            state_fun(&res.elements, &blocks);
+        else
+            blocks = 0;
+        res.alloc_delta += blocks;
+        report_result(&res);
+    }
+
+    /* Command list is gone after quit */
+    if (!latency_stats || quit_flag)
+        return ok;
+    pthread_mutex_lock(&latency_lock);
+    if (!cmd->latency) {
+        cmd->latency = malloc_or_fail(sizeof(hist_t), "call_cmd");
+        hist_init(cmd->latency);
+    }
+    hist_record(cmd->latency, elapsed);
+    pthread_mutex_unlock(&latency_lock);
+    return ok;
+}
+
+/* Invoke a command, counting it for the metrics.  Every way of running a
+ * command, repeat included, comes through here.
+ */
+static bool call_cmd(cmd_element_t *cmd, int argc, char *argv[])
+{
+    /* These act on the console itself, which belongs to the main thread */
+    if (web_worker &&
+        (cmd->operation == do_quit || cmd->operation == do_source ||
+         cmd->operation == do_web || cmd->operation == do_unix)) {
+        report(1, "'%s' is not available to web clients served by threads",
+               argv[0]);
+        return false;
+    }
+
+    /* Counted before running, since quit frees the command list */
+    __atomic_fetch_add(&cmd->calls, 1, __ATOMIC_RELAXED);
+    bool ok = record_cmd(cmd, argc, argv);
+    if (!ok && !quit_flag)
+        __atomic_fetch_add(&cmd->failures, 1, __ATOMIC_RELAXED);
+    return ok;
+}
+
+/* Append a command to the innermost block being recorded */
+static bool repeat_add(cmd_element_t *cmd, int argc, char *argv[])
+{
+    repeat_cmd_t *r = malloc_or_fail(sizeof(repeat_cmd_t), "repeat_add");
+    r->cmd = cmd;
+    r->argc = argc;
+    r->argv = calloc_or_fail(argc, sizeof(char *), "repeat_add");
+    for (int i = 0; i < argc; i++)
+        r->argv[i] = strsave_or_fail(argv[i], "repeat_add");
+    r->count = 0;
+    r->body = NULL;
+    r->wrap = NULL;
+    r->next = NULL;
+
+    repeat_cmd_t ***tail = &repeat_stack[repeat_depth - 1].tail;
+    **tail = r;
+    *tail = &r->next;
+    return true;
+}
+
+/* Free a list of recorded commands, including nested blocks */
+static void repeat_free(repeat_cmd_t *r)
+{
+    while (r) {
+        repeat_cmd_t *next = r->next;
+        if (r->cmd) {
+            for (int i = 0; i < r->argc; i++)
+                free_string(r->argv[i]);
+            free_array(r->argv, r->argc, sizeof(char *));
+        } else {
+            repeat_free(r->body);
+        }
+        free_block(r, sizeof(repeat_cmd_t));
+        r = next;
+    }
+}
+
+/* Does the command start a block: 'repeat n', possibly run by 'time' or
+ * 'perf'?
+ */
+static bool opens_block(cmd_element_t *cmd, int argc, char *argv[])
+{
+    while (cmd && (cmd->operation == do_time || cmd->operation == do_perf) &&
+           argc > 1) {
+        argc--;
+        argv++;
+        cmd = find_cmd(argv[0]);
+    }
+    return cmd && cmd->operation == do_repeat && argc == 2;
+}
+
+/* Run a command that has already been looked up.
+ * Inside a repeat block, the command is recorded instead.
+ */
+static bool exec_cmd(cmd_element_t *cmd, int argc, char *argv[])
+{
+    if (repeat_depth > 0 && cmd->operation != do_end &&
+        !opens_block(cmd, argc, argv))
+        return repeat_add(cmd, argc, argv);
+
+    bool ok = call_cmd(cmd, argc, argv);
+    if (!ok)
+        record_error();
+    return ok;
+}
+
 /* Execute a command that has already been split into arguments */
 static bool interpret_cmda(int argc, char *argv[])
 {
     if (argc == 0)
         return true;
     /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
-    bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
-    if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
-        if (!ok)
-            record_error();
-    } else {
-        report(1, "Unknown command '%s'", argv[0]);
-        record_error();
-        ok = false;
-    }
+    cmd_element_t *next_cmd = find_cmd(argv[0]);
+    if (next_cmd)
+        return exec_cmd(next_cmd, argc, argv);
 
-    return ok;
+    report(1, "Unknown command '%s'", argv[0]);
+    record_error();
+    return false;
+}
+
+/* Running a command cut short would do something else than asked for */
+static bool reject_long_line()
+{
+    report(1, "Command line too long");
+    record_error();
+    return false;
 }
 
 /* Execute a command from a command line */
@@ -198,11 +441,18 @@ static bool interpret_cmd(char *cmdline)
 
     int argc;
     char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    if (!argv)
+        return reject_long_line();
+    return interpret_cmda(argc, argv);
+}
 
+/* Execute a command line on behalf of a client of a web worker thread */
+static bool interpret_web_cmd(char *cmdline)
+{
+    web_worker = true;
+    pthread_rwlock_rdlock(&quit_lock);
+    bool ok = interpret_cmd(cmdline);
+    pthread_rwlock_unlock(&quit_lock);
     return ok;
 }
 
@@ -215,6 +465,17 @@ void add_quit_helper(cmd_func_t qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+/* Set function that reports queue state */
+void set_state_func(state_func_t f)
+{
+    state_fun = f;
+}
+
+void set_cmd_lock_func(cmd_lock_func_t f)
+{
+    lock_fun = f;
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
@@ -224,15 +485,20 @@ void set_echo(bool on)
 /* Built-in commands */
 static bool do_quit(int argc, char *argv[])
 {
+    pthread_rwlock_wrlock(&quit_lock);
     cmd_element_t *c = cmd_list;
     bool ok = true;
+    cmd_list = NULL;
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
+        if (ele->latency)
+            free_block(ele->latency, sizeof(hist_t));
         free_block(ele, sizeof(cmd_element_t));
     }
 
     param_element_t *p = param_list;
+    param_list = NULL;
     while (p) {
         param_element_t *ele = p;
         p = p->next;
@@ -242,11 +508,28 @@ static bool do_quit(int argc, char *argv[])
     while (buf_stack)
         pop_file();
 
+    if (unix_ops) {
+        free_array(unix_ops, unix_n_ops, sizeof(cmd_element_t *));
+        unix_ops = NULL;
+        web_close_unix();
+    }
+
+    /* Discard a block that was never closed */
+    if (repeat_depth > 0) {
+        repeat_free(repeat_stack[0].block);
+        repeat_depth = 0;
+    }
+    if (perf_active) {
+        perf_close(&perf_ctrs);
+        perf_active = false;
+    }
+
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
 
     quit_flag = true;
+    pthread_rwlock_unlock(&quit_lock);
     return ok;
 }
 
@@ -379,9 +662,18 @@ static bool do_time(int argc, char *argv[])
         double elapsed = last_time - first_time;
         report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
     } else {
+        int depth = repeat_depth;
         ok = interpret_cmda(argc - 1, argv + 1);
         if (block_flag) {
             block_timing = true;
+        } else if (repeat_depth > depth) {
+            /* Opened a repeat block.  Time it once 'end' runs it, or each
+             * time it runs if nested.
+             */
+            if (depth > 0)
+                repeat_stack[depth].block->wrap = do_time;
+            else
+                repeat_timing = true;
         } else {
             delta = delta_time(&last_time);
             report(1, "Delta time = %.3f", delta);
@@ -391,18 +683,356 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+/* Print and release the counters opened by do_perf */
+static void perf_report()
+{
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+        if (perf_ctrs.fd[i] >= 0)
+            report(1, "  %-16s%16lu", perf_event_name(i),
+                   (unsigned long) perf_ctrs.value[i]);
+        else
+            report(1, "  %-16s%16s", perf_event_name(i), "not supported");
+    }
+    uint64_t cycles = perf_ctrs.value[PERF_cycles];
+    if (perf_ctrs.fd[PERF_instructions] >= 0 && cycles)
+        report(1, "  %-16s%16.2f", "IPC",
+               (double) perf_ctrs.value[PERF_instructions] / cycles);
+    if (perf_ctrs.running < perf_ctrs.enabled)
+        report(1, "  Counted %.0f%% of the time, scaled to all of it",
+               perf_ctrs.running * 100.0 / perf_ctrs.enabled);
+
+    perf_close(&perf_ctrs);
+    perf_active = false;
+}
+
+static bool do_perf(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s needs a command to measure", argv[0]);
+        return false;
+    }
+
+    /* Only a nested block gets here while recording.  Count it each time
+     * it runs.  It is recorded either way, so that its 'end' matches.
+     */
+    if (repeat_depth > 0) {
+        int depth = repeat_depth;
+        bool ok = interpret_cmda(argc - 1, argv + 1);
+        if (repeat_depth > depth && perf_active) {
+            report(1, "Cannot nest %s", argv[0]);
+            ok = false;
+        } else if (repeat_depth > depth) {
+            repeat_stack[depth].block->wrap = do_perf;
+        }
+        return ok;
+    }
+
+    if (perf_active) {
+        report(1, "Cannot nest %s", argv[0]);
+        return false;
+    }
+
+    if (!perf_open(&perf_ctrs)) {
+        report(1, "Hardware performance counters are not available");
+        perf_close(&perf_ctrs);
+        return interpret_cmda(argc - 1, argv + 1);
+    }
+    perf_active = true;
+
+    int depth = repeat_depth;
+    perf_start(&perf_ctrs);
+    bool ok = interpret_cmda(argc - 1, argv + 1);
+    perf_stop(&perf_ctrs);
+    if (repeat_depth > depth) {
+        /* Opened a repeat block.  Count it once 'end' runs it */
+        repeat_perf = true;
+        return ok;
+    }
+
+    perf_report();
+    return ok;
+}
+
+static bool repeat_nested(repeat_cmd_t *blk);
+
+/* Run every command of a block count times, without any parsing or lookup.
+ * Stop at the first failure.
+ */
+static bool repeat_run(repeat_cmd_t *body, int count)
+{
+    bool ok = true;
+    for (int i = 0; ok && !quit_flag && i < count; i++) {
+        for (repeat_cmd_t *r = body; ok && !quit_flag && r; r = r->next)
+            ok = r->cmd ? call_cmd(r->cmd, r->argc, r->argv)
+                        : repeat_nested(r);
+    }
+    return ok;
+}
+
+/* Run a nested block, timed or counted if it was recorded so */
+static bool repeat_nested(repeat_cmd_t *blk)
+{
+    if (blk->wrap == do_perf) {
+        if (perf_active) {
+            report(1, "Cannot nest perf");
+            return false;
+        }
+        if (perf_open(&perf_ctrs)) {
+            perf_active = true;
+            perf_start(&perf_ctrs);
+        } else {
+            report(1, "Hardware performance counters are not available");
+            perf_close(&perf_ctrs);
+        }
+    } else if (blk->wrap == do_time) {
+        delta_time(&last_time);
+    }
+
+    bool ok = repeat_run(blk->body, blk->count);
+
+    if (perf_active && blk->wrap == do_perf) {
+        perf_stop(&perf_ctrs);
+        perf_report();
+    } else if (blk->wrap == do_time) {
+        report(1, "Delta time = %.3f", delta_time(&last_time));
+    }
+    return ok;
+}
+
+static bool do_repeat(int argc, char *argv[])
+{
+    int count;
+    if (argc < 2) {
+        report(1, "%s needs a repetition count", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &count) || count < 0) {
+        report(1, "Invalid repetition count '%s'", argv[1]);
+        return false;
+    }
+
+    if (argc > 2) {
+        /* Single command: look it up once, then run it count times */
+        cmd_element_t *cmd = find_cmd(argv[2]);
+        if (!cmd) {
+            report(1, "Unknown command '%s'", argv[2]);
+            return false;
+        }
+        bool ok = true;
+        for (int i = 0; ok && !quit_flag && i < count; i++)
+            ok = call_cmd(cmd, argc - 2, argv + 2);
+        return ok;
+    }
+
+    /* Start recording a block up to the matching 'end' */
+    if (repeat_running) {
+        report(1, "Cannot start a repeat block while running one");
+        return false;
+    }
+    if (repeat_depth == MAX_REPEAT_DEPTH) {
+        report(1, "Repeat blocks nested deeper than %d", MAX_REPEAT_DEPTH);
+        return false;
+    }
+    repeat_cmd_t *blk = malloc_or_fail(sizeof(repeat_cmd_t), "do_repeat");
+    blk->cmd = NULL;
+    blk->argc = 0;
+    blk->argv = NULL;
+    blk->count = count;
+    blk->body = NULL;
+    blk->wrap = NULL;
+    blk->next = NULL;
+    if (repeat_depth > 0) {
+        repeat_cmd_t ***tail = &repeat_stack[repeat_depth - 1].tail;
+        **tail = blk;
+        *tail = &blk->next;
+    }
+    repeat_stack[repeat_depth].block = blk;
+    repeat_stack[repeat_depth].tail = &blk->body;
+    repeat_depth++;
+    return true;
+}
+
+static bool do_end(int argc, char *argv[])
+{
+    if (repeat_depth == 0) {
+        report(1, "'%s' without matching 'repeat'", argv[0]);
+        return false;
+    }
+
+    repeat_cmd_t *blk = repeat_stack[--repeat_depth].block;
+    if (repeat_depth > 0)
+        return true;
+
+    /* Closed the outermost block: run it */
+    if (repeat_timing)
+        delta_time(&last_time);
+    if (repeat_perf)
+        perf_start(&perf_ctrs);
+    repeat_running = true;
+    bool ok = repeat_run(blk->body, blk->count);
+    repeat_running = false;
+    if (repeat_perf) {
+        perf_stop(&perf_ctrs);
+        repeat_perf = false;
+        perf_report();
+    }
+    if (repeat_timing) {
+        repeat_timing = false;
+        report(1, "Delta time = %.3f", delta_time(&last_time));
+    }
+    repeat_free(blk);
+    return ok;
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        pthread_mutex_lock(&latency_lock);
+        for (cmd_element_t *c = cmd_list; c; c = c->next) {
+            if (c->latency)
+                hist_init(c->latency);
+        }
+        pthread_mutex_unlock(&latency_lock);
+        return true;
+    }
+    if (argc != 1) {
+        report(1, "%s takes no arguments or 'reset'", argv[0]);
+        return false;
+    }
+
+    if (!latency_stats)
+        report(1, "Latency recording is off.  Use 'option latency 1'");
+    report(1, "%-12s%10s%12s%12s%12s%12s", "Command", "count", "p50(ns)",
+           "p90(ns)", "p99(ns)", "max(ns)");
+    pthread_mutex_lock(&latency_lock);
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        hist_t *h = c->latency;
+        if (!h || !h->count)
+            continue;
+        report(1, "%-12s%10lu%12lu%12lu%12lu%12lu", c->name,
+               (unsigned long) h->count,
+               (unsigned long) hist_percentile(h, 0.5),
+               (unsigned long) hist_percentile(h, 0.9),
+               (unsigned long) hist_percentile(h, 0.99),
+               (unsigned long) h->max);
+    }
+    pthread_mutex_unlock(&latency_lock);
+    return true;
+}
+
+/* Append the metrics of the interpreter and the queues to the response of
+ * the web server, in the Prometheus text format.  Everything is counted as
+ * commands run, so this only reads the counters.
+ */
+static void cmd_metrics(void)
+{
+    cmd_element_t *c;
+
+    report_capture("# HELP qtest_commands_total Commands run.\n"
+                   "# TYPE qtest_commands_total counter\n");
+    for (c = cmd_list; c; c = c->next) {
+        uint64_t calls = __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+        if (calls)
+            report_capture("qtest_commands_total{command=\"%s\"} %lu\n",
+                           c->name, (unsigned long) calls);
+    }
+    report_capture("# HELP qtest_command_failures_total Commands that failed.\n"
+                   "# TYPE qtest_command_failures_total counter\n");
+    for (c = cmd_list; c; c = c->next) {
+        uint64_t failures = __atomic_load_n(&c->failures, __ATOMIC_RELAXED);
+        if (failures)
+            report_capture(
+                "qtest_command_failures_total{command=\"%s\"} %lu\n",
+                c->name, (unsigned long) failures);
+    }
+    report_capture("# HELP qtest_errors_total Errors counted against the "
+                   "error limit.\n"
+                   "# TYPE qtest_errors_total counter\n"
+                   "qtest_errors_total %d\n",
+                   __atomic_load_n(&err_cnt, __ATOMIC_RELAXED));
+
+    if (latency_stats) {
+        report_capture("# HELP qtest_command_latency_ns Command latency "
+                       "percentiles in nanoseconds.\n"
+                       "# TYPE qtest_command_latency_ns summary\n");
+        pthread_mutex_lock(&latency_lock);
+        for (c = cmd_list; c; c = c->next) {
+            hist_t *h = c->latency;
+            if (!h || !h->count)
+                continue;
+            static const double quantiles[] = {0.5, 0.9, 0.99};
+            for (int i = 0; i < 3; i++)
+                report_capture(
+                    "qtest_command_latency_ns{command=\"%s\",quantile=\"%g\"} "
+                    "%lu\n",
+                    c->name, quantiles[i],
+                    (unsigned long) hist_percentile(h, quantiles[i]));
+            report_capture(
+                "qtest_command_latency_ns_sum{command=\"%s\"} %lu\n"
+                "qtest_command_latency_ns_count{command=\"%s\"} %lu\n",
+                c->name, (unsigned long) h->sum, c->name,
+                (unsigned long) h->count);
+        }
+        pthread_mutex_unlock(&latency_lock);
+    }
+
+    if (state_fun) {
+        long elements = 0, blocks = 0;
+        state_fun(&elements, &blocks);
+        report_capture("# HELP qtest_queue_elements Elements in all queues.\n"
+                       "# TYPE qtest_queue_elements gauge\n"
+                       "qtest_queue_elements %ld\n"
+                       "# HELP qtest_allocated_blocks Blocks allocated by "
+                       "the queue code.\n"
+                       "# TYPE qtest_allocated_blocks gauge\n"
+                       "qtest_allocated_blocks %ld\n",
+                       elements, blocks);
+    }
+
+    size_t current, peak, allocs;
+    heap_usage(&current, &peak, &allocs);
+    report_capture("# HELP qtest_heap_bytes Bytes allocated by qtest itself.\n"
+                   "# TYPE qtest_heap_bytes gauge\n"
+                   "qtest_heap_bytes %zu\n"
+                   "# HELP qtest_heap_peak_bytes Most bytes allocated by "
+                   "qtest itself.\n"
+                   "# TYPE qtest_heap_peak_bytes gauge\n"
+                   "qtest_heap_peak_bytes %zu\n"
+                   "# HELP qtest_heap_allocations_total Allocations by "
+                   "qtest itself.\n"
+                   "# TYPE qtest_heap_allocations_total counter\n"
+                   "qtest_heap_allocations_total %zu\n",
+                   current, peak, allocs);
+}
+
+/* Metrics for a client of the web server.  Like commands from the web, they
+ * are read under quit_lock, so that quit cannot free the command list
+ * meanwhile, and the queue state under the lock of the chain.
+ */
+static void web_cmd_metrics(void)
+{
+    pthread_rwlock_rdlock(&quit_lock);
+    cmd_metrics();
+    pthread_rwlock_unlock(&quit_lock);
+}
+
 static bool use_linenoise = true;
-static int web_fd;
+static int web_fd = -1;
 
 static bool do_web(int argc, char *argv[])
 {
     int port = 9999;
-    if (argc == 2) {
+    int threads = 0;
+    if (argc >= 2) {
         if (argv[1][0] >= '0' && argv[1][0] <= '9')
             port = atoi(argv[1]);
     }
+    if (argc >= 3 && (!get_int(argv[2], &threads) || threads < 0)) {
+        report(1, "Invalid number of threads '%s'", argv[2]);
+        return false;
+    }
 
-    web_fd = web_open(port);
+    web_fd = web_open(port, web_cmd_metrics);
     if (web_fd > 0) {
         printf("listen on port %d, fd is %d\n", port, web_fd);
         use_linenoise = false;
@@ -410,6 +1040,13 @@ static bool do_web(int argc, char *argv[])
         perror("ERROR");
         exit(web_fd);
     }
+
+    /* Otherwise clients are served by the console thread, between commands */
+    if (threads &&
+        !web_start_workers(threads, interpret_web_cmd)) {
+        report(1, "Could not start threads to serve web clients");
+        return false;
+    }
     return true;
 }
 
@@ -429,13 +1066,29 @@ void init_cmd()
     ADD_COMMAND(source, "Read commands from source file", "");
     ADD_COMMAND(log, "Copy output to file", "file");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
-    ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
+    ADD_COMMAND(perf, "Count cycles, cache and branch misses of command",
+                "cmd arg ...");
+    ADD_COMMAND(web, "Read commands from builtin web server",
+                "[port [threads]]");
+    ADD_COMMAND(unix,
+                "Read commands in binary form from a Unix domain socket "
+                "(default: qtest.sock)",
+                "[path]");
+    ADD_COMMAND(repeat,
+                "Run command n times. Without a command, repeat the following "
+                "lines up to 'end'",
+                "n [cmd arg ...]");
+    ADD_COMMAND(end, "End block of commands started by repeat", "");
+    ADD_COMMAND(stats, "Show or reset per-command latency percentiles",
+                "[reset]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("latency", &latency_stats,
+              "Record latency of every command for 'stats'", NULL);
 
     init_in();
     init_time(&last_time);
@@ -460,9 +1113,27 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->count = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_len = 0;
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
+    /* Map regular files as a whole, so that large traces are scanned in
+     * place instead of being read() RIO_BUFSIZE bytes at a time.
+     * Anything that cannot be mapped falls back to buffered reads.
+     */
+    struct stat st;
+    if (fname && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->map_len = st.st_size;
+            rnew->bufptr = map;
+            rnew->count = st.st_size;
+        }
+    }
+
     return true;
 }
 
@@ -472,6 +1143,8 @@ static void pop_file()
     if (buf_stack) {
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_len);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -483,60 +1156,77 @@ static void init_in()
     buf_stack = NULL;
 }
 
-/* Read command from input file.
- * When hit EOF, close that file and return NULL
+/* Read command from input file, without echoing it.
+ * When hit EOF, close that file and return NULL.  A line that does not fit
+ * in linebuf is cut short, with line_cut set, and the rest of it skipped.
  */
-static char *readline()
+static char *read_line()
 {
-    char c;
-    char *lptr = linebuf;
+    size_t len = 0;
 
     if (!buf_stack)
         return NULL;
 
-    for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
+    line_cut = false;
+    for (;;) {
         if (buf_stack->count <= 0) {
-            /* Need to read from input file */
-            buf_stack->count = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
+            /* Need to read from input file.  A mapped file has no more
+             * data once the mapping is consumed.
+             */
+            buf_stack->count =
+                buf_stack->map
+                    ? 0
+                    : read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
             buf_stack->bufptr = buf_stack->buf;
             if (buf_stack->count <= 0) {
                 /* Encountered EOF */
                 pop_file();
-                if (cnt > 0) {
+                if (len > 0) {
                     /* Last line of file did not terminate with newline. */
                     /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
+                    linebuf[len++] = '\n';
+                    linebuf[len] = '\0';
                     return linebuf;
                 }
                 return NULL;
             }
         }
 
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->count--;
-        if (c == '\n')
+        /* Have text in buffer.  Copy up to and including the next newline,
+         * or the whole buffer if there is none, as much as fits.
+         */
+        char *nl = memchr(buf_stack->bufptr, '\n', buf_stack->count);
+        size_t n = nl ? nl - buf_stack->bufptr + 1 : buf_stack->count;
+        size_t copy = n;
+        if (copy > RIO_BUFSIZE - 2 - len) {
+            copy = RIO_BUFSIZE - 2 - len;
+            line_cut = true;
+        }
+        memcpy(linebuf + len, buf_stack->bufptr, copy);
+        buf_stack->bufptr += n;
+        buf_stack->count -= n;
+        len += copy;
+        if (nl)
             break;
     }
 
-    if (c != '\n') {
+    if (linebuf[len - 1] != '\n') {
         /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
+        linebuf[len++] = '\n';
     }
-    *lptr++ = '\0';
+    linebuf[len] = '\0';
+    return linebuf;
+}
 
-    if (echo) {
+/* Read command from input file, echoing it if asked to */
+static char *readline()
+{
+    char *line = read_line();
+    if (line && echo) {
         report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
+        report_noreturn(1, line);
     }
-
-    return linebuf;
+    return line;
 }
 
 static bool cmd_done()
@@ -553,7 +1243,6 @@ static bool cmd_done()
  * nfds should be set to the maximum file descriptor for network sockets.
  * If nfds == 0, this indicates that there is no pending network activity
  */
-int web_connfd;
 static int cmd_select(int nfds,
                       fd_set *readfds,
                       fd_set *writefds,
@@ -606,24 +1295,14 @@ static int cmd_select(int nfds,
 
         set_echo(0);
         char *cmdline = readline();
-        if (cmdline)
+        if (cmdline && line_cut)
+            reject_long_line();
+        else if (cmdline)
             interpret_cmd(cmdline);
-    } else if (readfds && FD_ISSET(web_fd, readfds)) {
+    } else if (readfds && web_fd != -1 && FD_ISSET(web_fd, readfds)) {
         FD_CLR(web_fd, readfds);
         result--;
-        struct sockaddr_in clientaddr;
-        socklen_t clientlen = sizeof(clientaddr);
-        web_connfd =
-            accept(web_fd, (struct sockaddr *) &clientaddr, &clientlen);
-
-        char *p = web_recv(web_connfd, &clientaddr);
-        char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
-        web_send(web_connfd, buffer);
-
-        if (p)
-            interpret_cmd(p);
-        free(p);
-        close(web_connfd);
+        web_handle(interpret_cmd);
     }
     return result;
 }
@@ -678,6 +1357,185 @@ void completion(const char *buf, line_completions_t *lc)
     }
 }
 
+/* Pipelined reading of command files.
+ *
+ * A reader thread reads and tokenizes the lines of the input file, looks up
+ * their commands and queues them, while the console thread runs the
+ * commands queued before.  Commands that change where input comes from, and
+ * lines that may run them, are run before the reader goes on, so that it
+ * continues with a sourced file, or leaves the rest of the input to
+ * cmd_select once the web server or the Unix domain socket is open.
+ */
+
+#define PIPE_DEPTH 64
+
+typedef struct {
+    cmd_element_t *cmd;     /* NULL if unknown */
+    int argc;               /* 0 if the line was too long */
+    bool barrier;           /* Reader waits until the command has run */
+    char args[RIO_BUFSIZE]; /* The words of the line, each null-terminated */
+} pipe_slot_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t filled;  /* Signaled when a line was queued, or on EOF */
+    pthread_cond_t drained; /* Signaled when a line has run */
+    pipe_slot_t *slots;
+    unsigned head, count;
+    bool full;    /* Reader waits for the queue to drain to half */
+    bool idle;    /* Console thread waits for a line */
+    bool waiting; /* Reader waits for its last line to run */
+    bool stop;    /* Reader must not read any further */
+    bool eof;     /* Reader is done */
+} pipe_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .filled = PTHREAD_COND_INITIALIZER,
+    .drained = PTHREAD_COND_INITIALIZER,
+};
+
+/* Could running this line change the input? */
+static bool pipe_barrier(cmd_element_t *cmd, int argc, char *argv[])
+{
+    static const char *names[] = {"source", "quit", "web", "unix"};
+    /* The block that 'end' runs may hold any of them */
+    if (cmd && cmd->operation == do_end)
+        return true;
+    for (int i = 0; i < argc; i++) {
+        for (size_t j = 0; j < sizeof(names) / sizeof(names[0]); j++) {
+            if (!strcmp(argv[i], names[j]))
+                return true;
+        }
+    }
+    return false;
+}
+
+static void *pipe_reader(void *arg)
+{
+    char *line;
+    pthread_mutex_lock(&pipe_state.lock);
+    while (!pipe_state.stop) {
+        pthread_mutex_unlock(&pipe_state.lock);
+        /* The console thread only touches the input while this one waits */
+        line = read_line();
+        int argc = 0;
+        char **argv = line && !line_cut ? parse_args(line, &argc) : NULL;
+        pthread_mutex_lock(&pipe_state.lock);
+        if (!line)
+            break;
+        if (argv && argc == 0)
+            continue;
+
+        /* Wake up for half a queue at a time rather than for every line */
+        while (pipe_state.count == PIPE_DEPTH && !pipe_state.stop) {
+            pipe_state.full = true;
+            pthread_cond_wait(&pipe_state.drained, &pipe_state.lock);
+        }
+        if (pipe_state.stop)
+            break;
+
+        /* Slots past the queued ones belong to this thread */
+        pipe_slot_t *s = &pipe_state.slots[(pipe_state.head +
+                                            pipe_state.count) %
+                                           PIPE_DEPTH];
+        if (argv) {
+            char *last = argv[argc - 1];
+            s->cmd = find_cmd(argv[0]);
+            s->argc = argc;
+            s->barrier = pipe_barrier(s->cmd, argc, argv);
+            memcpy(s->args, argv[0], last + strlen(last) + 1 - argv[0]);
+        } else {
+            /* Too long, to be rejected in turn */
+            s->cmd = NULL;
+            s->argc = 0;
+            s->barrier = false;
+        }
+        pipe_state.count++;
+        if (pipe_state.idle)
+            pthread_cond_signal(&pipe_state.filled);
+
+        pipe_state.waiting = s->barrier;
+        while (pipe_state.waiting && !pipe_state.stop)
+            pthread_cond_wait(&pipe_state.drained, &pipe_state.lock);
+    }
+    pipe_state.eof = true;
+    pthread_cond_signal(&pipe_state.filled);
+    pthread_mutex_unlock(&pipe_state.lock);
+    return NULL;
+}
+
+/* Run the commands of the input file as the reader thread queues them.
+ * Return false if the thread could not be started.
+ */
+static bool run_pipeline()
+{
+    pipe_state.slots =
+        malloc_or_fail(PIPE_DEPTH * sizeof(pipe_slot_t), "run_pipeline");
+    pipe_state.head = pipe_state.count = 0;
+    pipe_state.full = pipe_state.idle = false;
+    pipe_state.waiting = pipe_state.stop = pipe_state.eof = false;
+
+    pthread_t reader;
+    if (!start_thread(&reader, pipe_reader, NULL)) {
+        free_block(pipe_state.slots, PIPE_DEPTH * sizeof(pipe_slot_t));
+        return false;
+    }
+
+    /* As for commands read by cmd_select, comments are shown but commands
+     * are not echoed.
+     */
+    set_echo(0);
+    pthread_mutex_lock(&pipe_state.lock);
+    for (;;) {
+        while (!pipe_state.count && !pipe_state.eof) {
+            pipe_state.idle = true;
+            pthread_cond_wait(&pipe_state.filled, &pipe_state.lock);
+        }
+        pipe_state.idle = false;
+        if (!pipe_state.count)
+            break;
+        pipe_slot_t *s = &pipe_state.slots[pipe_state.head];
+        pthread_mutex_unlock(&pipe_state.lock);
+
+        if (!quit_flag && !s->argc) {
+            reject_long_line();
+        } else if (!quit_flag) {
+            char *p = s->args;
+            for (int i = 0; i < s->argc; i++) {
+                argvbuf[i] = p;
+                p += strlen(p) + 1;
+            }
+            if (s->cmd)
+                exec_cmd(s->cmd, s->argc, argvbuf);
+            else
+                interpret_cmda(s->argc, argvbuf);
+        }
+
+        pthread_mutex_lock(&pipe_state.lock);
+        pipe_state.head = (pipe_state.head + 1) % PIPE_DEPTH;
+        pipe_state.count--;
+        bool wake = s->barrier || (pipe_state.full &&
+                                   pipe_state.count <= PIPE_DEPTH / 2);
+        if (s->barrier)
+            pipe_state.waiting = false;
+        if (quit_flag || web_fd != -1)
+            pipe_state.stop = wake = true;
+        if (wake) {
+            pipe_state.full = false;
+            pthread_cond_signal(&pipe_state.drained);
+        }
+    }
+    pthread_mutex_unlock(&pipe_state.lock);
+
+    pthread_join(reader, NULL);
+    free_block(pipe_state.slots, PIPE_DEPTH * sizeof(pipe_slot_t));
+    return true;
+}
+
+void set_pipelined(bool on)
+{
+    pipelined = on;
+}
+
 bool run_console(char *infile_name)
 {
     if (!push_file(infile_name)) {
@@ -701,9 +1559,302 @@ bool run_console(char *infile_name)
                 cmd_select(0, NULL, NULL, NULL, NULL);
         }
     } else {
+        /* What is left once the web server is open goes to cmd_select */
+        if (pipelined)
+            run_pipeline();
         while (!cmd_done())
             cmd_select(0, NULL, NULL, NULL, NULL);
     }
 
     return err_cnt == 0;
 }
+
+/* Binary traces.
+ *
+ * A compiled trace stores every command line of a text trace already split
+ * into words, with the command name replaced by an opcode.  Replaying it
+ * needs neither parse_args nor a search of the command list per line.
+ *
+ * Layout (native byte order):
+ *   header   "QTRC", uint32_t version, uint32_t number of names
+ *   names    for each opcode: uint16_t length, then the name bytes
+ *   records  until end of file:
+ *            uint16_t opcode, uint16_t argc, uint32_t size, then size bytes
+ *            holding argv[1..argc-1], each null-terminated
+ *
+ * The opcodes index the name table rather than cmd_list, so a trace stays
+ * valid when commands are added to qtest later.
+ */
+
+#define TRACE_MAGIC "QTRC"
+#define TRACE_VERSION 1
+
+static bool write_all(FILE *f, const void *p, size_t len)
+{
+    return fwrite(p, 1, len, f) == len;
+}
+
+/* Write the header of a trace, whose name table is the command list */
+static bool trace_write_header(FILE *out)
+{
+    uint32_t version = TRACE_VERSION;
+    uint32_t n_names = 0;
+    for (cmd_element_t *c = cmd_list; c; c = c->next)
+        n_names++;
+    bool ok = write_all(out, TRACE_MAGIC, 4) &&
+              write_all(out, &version, sizeof(version)) &&
+              write_all(out, &n_names, sizeof(n_names));
+    for (cmd_element_t *c = cmd_list; ok && c; c = c->next) {
+        uint16_t len = strlen(c->name);
+        ok = write_all(out, &len, sizeof(len)) && write_all(out, c->name, len);
+    }
+    return ok;
+}
+
+/* Point argvbuf at the argc - 1 null-terminated arguments of a record,
+ * held in the size bytes at args.  Return false if they are not all there.
+ */
+static bool trace_args(cmd_element_t *cmd, int argc, char *args, size_t size)
+{
+    char *args_end = args + size;
+    if (argc < 1 || argc > MAX_ARGC)
+        return false;
+    argvbuf[0] = cmd->name;
+    for (int i = 1; i < argc; i++) {
+        char *nul = memchr(args, '\0', args_end - args);
+        if (!nul)
+            return false;
+        argvbuf[i] = args;
+        args = nul + 1;
+    }
+    return true;
+}
+
+/* Compile text commands in infile_name into binary trace outfile_name */
+bool compile_trace(char *infile_name, char *outfile_name)
+{
+    if (!push_file(infile_name)) {
+        report(1, "ERROR: Could not open source file '%s'", infile_name);
+        return false;
+    }
+
+    FILE *out = fopen(outfile_name, "wb");
+    if (!out) {
+        report(1, "ERROR: Could not open output file '%s'", outfile_name);
+        pop_file();
+        return false;
+    }
+
+    bool ok = trace_write_header(out);
+
+    int saved_echo = echo;
+    echo = 0;
+    int lineno = 0;
+    char *cmdline;
+    while (ok && buf_stack && (cmdline = readline())) {
+        lineno++;
+        int argc;
+        char **argv = line_cut ? NULL : parse_args(cmdline, &argc);
+        if (!argv) {
+            report(1, "ERROR: Line %d is too long", lineno);
+            ok = false;
+            break;
+        }
+        if (argc == 0)
+            continue;
+
+        uint16_t op = 0;
+        cmd_element_t *c = cmd_list;
+        while (c && strcmp(argv[0], c->name) != 0) {
+            c = c->next;
+            op++;
+        }
+        if (!c) {
+            report(1, "ERROR: Unknown command '%s' at line %d", argv[0],
+                   lineno);
+            ok = false;
+            break;
+        }
+
+        uint16_t rec_argc = argc;
+        uint32_t size = 0;
+        for (int i = 1; i < argc; i++)
+            size += strlen(argv[i]) + 1;
+        ok = write_all(out, &op, sizeof(op)) &&
+             write_all(out, &rec_argc, sizeof(rec_argc)) &&
+             write_all(out, &size, sizeof(size));
+        for (int i = 1; ok && i < argc; i++)
+            ok = write_all(out, argv[i], strlen(argv[i]) + 1);
+    }
+    echo = saved_echo;
+
+    while (buf_stack)
+        pop_file();
+    if (fclose(out) != 0)
+        ok = false;
+    if (!ok)
+        report(1, "ERROR: Failed to compile '%s' into '%s'", infile_name,
+               outfile_name);
+    return ok;
+}
+
+/* Fetch a field of len bytes from the trace, advancing *pos */
+static bool trace_get(const char *map,
+                      size_t map_len,
+                      size_t *pos,
+                      void *dst,
+                      size_t len)
+{
+    if (map_len - *pos < len)
+        return false;
+    memcpy(dst, map + *pos, len);
+    *pos += len;
+    return true;
+}
+
+/* Run commands from binary trace produced by compile_trace */
+bool replay_trace(char *infile_name)
+{
+    int fd = open(infile_name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || st.st_size == 0) {
+        report(1, "ERROR: Could not open trace file '%s'", infile_name);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    /* Mapped writable but private, since commands receive non-const argv */
+    size_t map_len = st.st_size;
+    char *map =
+        mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        report(1, "ERROR: Could not map trace file '%s'", infile_name);
+        return false;
+    }
+
+    size_t pos = 0;
+    char magic[4];
+    uint32_t version, n_names;
+    if (!trace_get(map, map_len, &pos, magic, 4) ||
+        memcmp(magic, TRACE_MAGIC, 4) ||
+        !trace_get(map, map_len, &pos, &version, sizeof(version)) ||
+        version != TRACE_VERSION ||
+        !trace_get(map, map_len, &pos, &n_names, sizeof(n_names))) {
+        report(1, "ERROR: '%s' is not a compiled trace", infile_name);
+        munmap(map, map_len);
+        return false;
+    }
+
+    /* Resolve opcodes to commands once, up front */
+    cmd_element_t **ops =
+        calloc_or_fail(n_names, sizeof(cmd_element_t *), "replay_trace");
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < n_names; i++) {
+        uint16_t len;
+        char name[RIO_BUFSIZE];
+        ok = trace_get(map, map_len, &pos, &len, sizeof(len)) &&
+             len < sizeof(name) && trace_get(map, map_len, &pos, name, len);
+        if (ok) {
+            name[len] = '\0';
+            ops[i] = find_cmd(name);
+        }
+    }
+
+    /* As for commands read by cmd_select, comments are shown but commands
+     * are not echoed.
+     */
+    set_echo(0);
+    while (ok && !quit_flag && pos < map_len) {
+        uint16_t op, argc;
+        uint32_t size;
+        ok = trace_get(map, map_len, &pos, &op, sizeof(op)) &&
+             trace_get(map, map_len, &pos, &argc, sizeof(argc)) &&
+             trace_get(map, map_len, &pos, &size, sizeof(size)) &&
+             op < n_names && argc >= 1 && argc <= MAX_ARGC &&
+             map_len - pos >= size;
+        if (!ok)
+            break;
+
+        cmd_element_t *cmd = ops[op];
+        if (!cmd) {
+            report(1, "Unknown command in trace (opcode %u)", op);
+            record_error();
+            pos += size;
+            continue;
+        }
+
+        ok = trace_args(cmd, argc, map + pos, size);
+        pos += size;
+        if (!ok)
+            break;
+
+        exec_cmd(cmd, argc, argvbuf);
+
+        /* Commands from files opened with 'source' */
+        while (!cmd_done())
+            cmd_select(0, NULL, NULL, NULL, NULL);
+    }
+
+    if (!ok)
+        report(1, "ERROR: Trace file '%s' is corrupted", infile_name);
+    free_array(ops, n_names, sizeof(cmd_element_t *));
+    munmap(map, map_len);
+    return ok && err_cnt == 0;
+}
+
+/* Commands from the Unix domain socket.
+ *
+ * Its clients speak the binary form of compiled traces: they are greeted
+ * with the header of a trace, whose opcodes index the command list, and
+ * send records of the same layout.
+ */
+
+static bool run_unix_op(unsigned op, int argc, char *args, size_t size)
+{
+    if (quit_flag)
+        return false;
+    if (op >= unix_n_ops || !trace_args(unix_ops[op], argc, args, size)) {
+        report(1, "Malformed record (opcode %u)", op);
+        record_error();
+        return false;
+    }
+    return exec_cmd(unix_ops[op], argc, argvbuf);
+}
+
+static bool do_unix(int argc, char *argv[])
+{
+    char *path = argc >= 2 ? argv[1] : "qtest.sock";
+    if (unix_ops) {
+        report(1, "Already listening on a Unix domain socket");
+        return false;
+    }
+
+    char *hello = NULL;
+    size_t hello_len = 0;
+    FILE *f = open_memstream(&hello, &hello_len);
+    bool ok = f && trace_write_header(f);
+    if (f && fclose(f))
+        ok = false;
+    int fd = ok ? web_open_unix(path, hello, hello_len, run_unix_op) : -1;
+    int err = errno;
+    free(hello);
+    if (fd < 0) {
+        report(1, "Could not listen on Unix domain socket '%s': %s", path,
+               strerror(err));
+        return false;
+    }
+
+    for (cmd_element_t *c = cmd_list; c; c = c->next)
+        unix_n_ops++;
+    unix_ops = calloc_or_fail(unix_n_ops, sizeof(cmd_element_t *), "do_unix");
+    size_t i = 0;
+    for (cmd_element_t *c = cmd_list; c; c = c->next)
+        unix_ops[i++] = c;
+
+    printf("listen on %s, fd is %d\n", path, fd);
+    web_fd = fd;
+    use_linenoise = false;
+    return true;
+}
@@ -2,8 +2,10 @@
 #define LAB0_CONSOLE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/select.h>
 
+#include "histogram.h"
 #include "linenoise.h"
 
 #define HISTORY_FILE ".cmd_history"
@@ -24,6 +26,9 @@ typedef struct __cmd_element {
     cmd_func_t operation;
     char *summary;
     char *param;
+    hist_t *latency; /* Latency in ns, when recording with option latency */
+    uint64_t calls;    /* Times run, and times failed, for the metrics */
+    uint64_t failures;
     struct __cmd_element *next;
 } cmd_element_t;
 
@@ -56,6 +61,19 @@ bool get_int(char *vname, int *loc);
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
+/* Optionally supply function that reports the total number of elements in
+ * all queues and the number of allocated blocks, for machine-readable output
+ */
+typedef void (*state_func_t)(long *elements, long *blocks);
+void set_state_func(state_func_t f);
+
+/* Optionally supply function that takes, when lock is set, and releases
+ * otherwise, whatever the operation of a command needs so that it can run
+ * while web worker threads run other commands.
+ */
+typedef void (*cmd_lock_func_t)(cmd_func_t op, bool lock);
+void set_cmd_lock_func(cmd_lock_func_t f);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
@@ -64,10 +82,23 @@ void set_echo(bool on);
 /* Return true if no errors occurred */
 bool finish_cmd();
 
+/* Read commands from the input file in a separate thread, up to a bounded
+ * number of lines ahead of the one running
+ */
+void set_pipelined(bool on);
+
 /* Run command loop.  Non-null infile_name implies read commands from that file
  */
 bool run_console(char *infile_name);
 
+/* Compile text commands in infile_name into binary trace outfile_name.
+ * Return true if successful.
+ */
+bool compile_trace(char *infile_name, char *outfile_name);
+
+/* Run commands from binary trace produced by compile_trace */
+bool replay_trace(char *infile_name);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, line_completions_t *lc);
 
@@ -10,9 +10,10 @@
 #include "random.h"
 
 /* Maintain a queue independent from the qtest since
- * we do not want the test to affect the original functionality
+ * we do not want the test to affect the original functionality.
+ * Every measurement thread has its own queue and input strings.
  */
-static struct list_head *l = NULL;
+static __thread struct list_head *l = NULL;
 
 #define dut_new() ((void) (l = q_new()))
 
@@ -36,10 +37,10 @@ static struct list_head *l = NULL;
             q_insert_tail(l, s); \
     } while (0)
 
-#define dut_free() ((void) (q_free(l)))
+#define dut_free() ((void) (q_free(l), l = NULL))
 
-static char random_string[N_MEASURES][8];
-static int random_string_iter = 0;
+static __thread char random_string[N_MEASURES][8];
+static __thread int random_string_iter = 0;
 
 /* Implement the necessary queue interface to simulation */
 void init_dut(void)
@@ -69,9 +70,94 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
     }
 }
 
-static int cmp(const int64_t *a, const int64_t *b)
+/* Class 0 inputs are all zero, see prepare_inputs() */
+static bool is_fixed_class(const uint8_t *chunk)
 {
-    return (int) (*a - *b);
+    for (size_t i = 0; i < CHUNK_SIZE; i++) {
+        if (chunk[i])
+            return false;
+    }
+    return true;
+}
+
+/* Fill the queue with SORT_SIZE random strings, pre-sorted for class 0 */
+static void dut_insert_sort_input(const uint8_t *chunk)
+{
+    for (int j = 0; j < SORT_SIZE; j++)
+        q_insert_tail(l, get_random_string());
+    if (is_fixed_class(chunk))
+        q_sort(l, false);
+}
+
+/* Bring the queue to a size drawn from the chunk of a measurement, at least
+ * min, and return that size.  The elements left by the previous measurement
+ * are reused, so only the difference in size goes through malloc and free
+ * rather than the whole queue.  Returning the size spares the measurement a
+ * walk of the queue, whose length depends on the class, right before it.
+ */
+static int dut_reset(const uint8_t *chunk, int min)
+{
+    int n = *(uint16_t *) chunk % QUEUE_SIZE + min;
+    if (!l)
+        dut_new();
+    int size = q_size(l);
+    if (size < n)
+        dut_insert_head(get_random_string(), n - size);
+    for (; size > n; size--) {
+        element_t *e = q_remove_head(l, NULL, 0);
+        if (!e)
+            break;
+        q_release_element(e);
+    }
+
+    /* Growing the queue drains the free lists of malloc, shrinking it fills
+     * them.  Allocating and freeing one element leaves a free block of each
+     * size for the operation under test in both classes.
+     */
+    dut_insert_head(get_random_string(), 1);
+    element_t *e = q_remove_head(l, NULL, 0);
+    if (e)
+        q_release_element(e);
+    return n;
+}
+
+/* Radix key of a measurement.  Flipping the sign bit orders the negative
+ * values of wrapped-around cycle counters before all others.
+ */
+#define TIME_KEY(t) ((uint64_t) (t) ^ (UINT64_C(1) << 63))
+
+/* Sort N_MEASURES execution times with an LSD radix sort on bytes, which
+ * takes linear time instead of the O(n log n) comparisons of qsort.  A pass
+ * is skipped when all times share its byte, so the high bytes of small cycle
+ * counts cost a single counting scan.
+ */
+static void sort_times(int64_t *times)
+{
+    int64_t buf[N_MEASURES];
+    int64_t *src = times, *dst = buf;
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t count[256] = {0};
+        for (size_t i = 0; i < N_MEASURES; i++)
+            count[(TIME_KEY(src[i]) >> shift) & 0xff]++;
+        if (count[(TIME_KEY(src[0]) >> shift) & 0xff] == N_MEASURES)
+            continue;
+
+        size_t pos = 0;
+        for (size_t d = 0; d < 256; d++) {
+            size_t c = count[d];
+            count[d] = pos;
+            pos += c;
+        }
+        for (size_t i = 0; i < N_MEASURES; i++)
+            dst[count[(TIME_KEY(src[i]) >> shift) & 0xff]++] = src[i];
+
+        int64_t *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != times)
+        memcpy(times, src, sizeof(buf));
 }
 
 static int64_t percentile(int64_t *a, double which, size_t size)
@@ -82,39 +168,37 @@ static int64_t percentile(int64_t *a, double which, size_t size)
     return a[array_position];
 }
 
-void prepare_percentiles(int64_t *exec_times, int64_t *percentiles)
+/* The percentiles come from a sorted copy, since the order of exec_times
+ * must keep matching the classes of the measurements.
+ */
+void prepare_percentiles(const int64_t *exec_times, int64_t *percentiles)
 {
-    qsort(exec_times, N_MEASURES, sizeof(int64_t),
-          (int (*)(const void *, const void *)) cmp);
+    int64_t sorted[N_MEASURES];
+    memcpy(sorted, exec_times, sizeof(sorted));
+    sort_times(sorted);
     for (size_t i = 0; i < N_PERCENTILES; i++) {
         percentiles[i] = percentile(
-            exec_times, 1 - (pow(0.5, 10 * (double) (i + 1) / N_PERCENTILES)),
+            sorted, 1 - (pow(0.5, 10 * (double) (i + 1) / N_PERCENTILES)),
             N_MEASURES);
     }
 }
 
-bool measure(int64_t *before_ticks,
-             int64_t *after_ticks,
-             uint8_t *input_data,
-             int mode)
+static bool measure_mode(int64_t *before_ticks,
+                         int64_t *after_ticks,
+                         uint8_t *input_data,
+                         int mode)
 {
-    assert(mode == DUT(insert_head) || mode == DUT(insert_tail) ||
-           mode == DUT(remove_head) || mode == DUT(remove_tail));
+    assert(mode >= 0 && mode < N_DUTS);
 
     switch (mode) {
     case DUT(insert_head):
         for (size_t i = 0; i < N_MEASURES - 0; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            int before_size = dut_reset(input_data + i * CHUNK_SIZE, 0);
+            before_ticks[i] = cpucycles_begin();
             dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = cpucycles_end();
             int after_size = q_size(l);
-            dut_free();
             if (before_size != after_size - 1)
                 return false;
         }
@@ -122,67 +206,134 @@ bool measure(int64_t *before_ticks,
     case DUT(insert_tail):
         for (size_t i = 0; i < N_MEASURES - 0; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            int before_size = dut_reset(input_data + i * CHUNK_SIZE, 0);
+            before_ticks[i] = cpucycles_begin();
             dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = cpucycles_end();
             int after_size = q_size(l);
-            dut_free();
             if (before_size != after_size - 1)
                 return false;
         }
         break;
     case DUT(remove_head):
         for (size_t i = 0; i < N_MEASURES - 0; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            int before_size = dut_reset(input_data + i * CHUNK_SIZE, 1);
+            before_ticks[i] = cpucycles_begin();
             element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = cpucycles_end();
             int after_size = q_size(l);
             if (e)
                 q_release_element(e);
-            dut_free();
             if (before_size != after_size + 1)
                 return false;
         }
         break;
     case DUT(remove_tail):
         for (size_t i = 0; i < N_MEASURES - 0; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            int before_size = dut_reset(input_data + i * CHUNK_SIZE, 1);
+            before_ticks[i] = cpucycles_begin();
             element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = cpucycles_end();
             int after_size = q_size(l);
             if (e)
                 q_release_element(e);
-            dut_free();
             if (before_size != after_size + 1)
                 return false;
         }
         break;
-    default:
+    case DUT(size):
         for (size_t i = 0; i < N_MEASURES - 0; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            before_ticks[i] = cpucycles();
+            dut_reset(input_data + i * CHUNK_SIZE, 0);
+            before_ticks[i] = cpucycles_begin();
             dut_size(1);
-            after_ticks[i] = cpucycles();
+            after_ticks[i] = cpucycles_end();
+        }
+        break;
+    case DUT(delete_mid):
+        for (size_t i = 0; i < N_MEASURES - 0; i++) {
+            int before_size = dut_reset(input_data + i * CHUNK_SIZE, 1);
+            before_ticks[i] = cpucycles_begin();
+            bool ok = q_delete_mid(l);
+            after_ticks[i] = cpucycles_end();
+            int after_size = q_size(l);
+            if (!ok || before_size != after_size + 1)
+                return false;
+        }
+        break;
+    case DUT(swap):
+    case DUT(reverse):
+        for (size_t i = 0; i < N_MEASURES - 0; i++) {
+            int before_size = dut_reset(input_data + i * CHUNK_SIZE, 0);
+            before_ticks[i] = cpucycles_begin();
+            if (mode == DUT(swap))
+                q_swap(l);
+            else
+                q_reverse(l);
+            after_ticks[i] = cpucycles_end();
+            int after_size = q_size(l);
+            if (before_size != after_size)
+                return false;
+        }
+        break;
+    case DUT(sort):
+        for (size_t i = 0; i < N_MEASURES - 0; i++) {
+            dut_new();
+            dut_insert_sort_input(input_data + i * CHUNK_SIZE);
+            before_ticks[i] = cpucycles_begin();
+            q_sort(l, false);
+            after_ticks[i] = cpucycles_end();
+            int after_size = q_size(l);
             dut_free();
+            if (after_size != SORT_SIZE)
+                return false;
+        }
+        break;
+    case DUT(merge):
+        for (size_t i = 0; i < N_MEASURES - 0; i++) {
+            uint8_t *chunk = input_data + i * CHUNK_SIZE;
+            dut_new();
+            dut_insert_sort_input(chunk);
+            q_sort(l, false);
+
+            /* Class 0 merges two disjoint halves, class 1 two interleaved
+             * ones, both sorted and of the same size.
+             */
+            struct list_head *other = q_new();
+            struct list_head *node, *safe;
+            int j = 0;
+            list_for_each_safe (node, safe, l) {
+                if (is_fixed_class(chunk) ? j < SORT_SIZE / 2 : j & 1)
+                    list_move_tail(node, other);
+                j++;
+            }
+
+            LIST_HEAD(chain);
+            queue_contex_t ctx[2] = {
+                {.q = l, .size = SORT_SIZE - SORT_SIZE / 2, .id = 0},
+                {.q = other, .size = SORT_SIZE / 2, .id = 1},
+            };
+            list_add_tail(&ctx[0].chain, &chain);
+            list_add_tail(&ctx[1].chain, &chain);
+            before_ticks[i] = cpucycles_begin();
+            int size = q_merge(&chain, false);
+            after_ticks[i] = cpucycles_end();
+            q_free(other);
+            dut_free();
+            if (size != SORT_SIZE)
+                return false;
         }
+        break;
     }
     return true;
 }
+
+bool measure(int64_t *before_ticks,
+             int64_t *after_ticks,
+             uint8_t *input_data,
+             int mode)
+{
+    bool ret = measure_mode(before_ticks, after_ticks, input_data, mode);
+    /* Release the queue shared by the measurements of this batch */
+    dut_free();
+    return ret;
+}
@@ -14,11 +14,30 @@
 
 #define DROP_SIZE 20
 
+/* Number of elements sorted or merged per measurement */
+#define SORT_SIZE 256
+
+/* Bound of the random queue sizes.  A queue this small stays in the L1 cache,
+ * so cache misses do not set the random class apart from the fixed class of
+ * nearly empty queues, while a linear operation still stands out: walking
+ * even a few dozen elements costs more than the whole of an O(1) operation.
+ * With queues of up to 10000 elements, resizing them between measurements
+ * left the random class with colder caches, and correct O(1) operations
+ * failed the test.
+ */
+#define QUEUE_SIZE 64
+
 #define DUT_FUNCS  \
     _(insert_head) \
     _(insert_tail) \
     _(remove_head) \
-    _(remove_tail)
+    _(remove_tail) \
+    _(size)        \
+    _(delete_mid)  \
+    _(swap)        \
+    _(reverse)     \
+    _(sort)        \
+    _(merge)
 
 #define DUT(x) DUT_##x
 
@@ -26,11 +45,12 @@ enum {
 #define _(x) DUT(x),
     DUT_FUNCS
 #undef _
+    N_DUTS
 };
 
 void init_dut();
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
-void prepare_percentiles(int64_t *exec_times, int64_t *percentiles);
+void prepare_percentiles(const int64_t *exec_times, int64_t *percentiles);
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
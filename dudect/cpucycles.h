@@ -3,27 +3,95 @@
 
 #include <stdint.h>
 
+/* Timed regions are bracketed by cpucycles_begin() and cpucycles_end(), which
+ * keep the code under test from being reordered across the counter reads, and
+ * cpucycles_overhead() gives the cost of the reads themselves.
+ *
+ * Define CPUCYCLES_USE_CLOCK to count nanoseconds of CLOCK_MONOTONIC_RAW
+ * instead of reading the cycle counter.  This is also the fallback on
+ * architectures without a known counter.
+ */
+#if !defined(CPUCYCLES_USE_CLOCK) && !defined(__i386__) && \
+    !defined(__x86_64__) && !defined(__aarch64__)
+#define CPUCYCLES_USE_CLOCK
+#endif
+
+#if defined(CPUCYCLES_USE_CLOCK)
+#include <time.h>
+#define CPUCYCLES_UNIT "ns"
+
+static inline int64_t cpucycles_clock(void)
+{
+    struct timespec ts;
+#if defined(CLOCK_MONOTONIC_RAW)
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#elif defined(__aarch64__)
+#define CPUCYCLES_UNIT "ticks"
+#else
+#define CPUCYCLES_UNIT "cycles"
+#endif
+
 // http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
-static inline int64_t cpucycles(void)
+static inline int64_t cpucycles_begin(void)
 {
-#if defined(__i386__) || defined(__x86_64__)
+#if defined(CPUCYCLES_USE_CLOCK)
+    return cpucycles_clock();
+#elif defined(__i386__) || defined(__x86_64__)
+    /* lfence waits for all earlier instructions to complete, so none of them
+     * is counted, and keeps rdtsc from starting early.
+     */
     unsigned int hi, lo;
-    __asm__ volatile("rdtscp\n\t" : "=a"(lo), "=d"(hi));
+    __asm__ volatile("lfence\n\trdtsc" : "=a"(lo), "=d"(hi)::"memory");
     return ((int64_t) lo) | (((int64_t) hi) << 32);
-
-#elif defined(__aarch64__)
-    uint64_t val;
+#else
     /* According to ARM DDI 0487F.c, from Armv8.0 to Armv8.5 inclusive, the
      * system counter is at least 56 bits wide; from Armv8.6, the counter
      * must be 64 bits wide.  So the system counter could be less than 64
      * bits wide and it is attributed with the flag 'cap_user_time_short'
      * is true.
      */
-    asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(val)::"memory");
     return val;
+#endif
+}
+
+static inline int64_t cpucycles_end(void)
+{
+#if defined(CPUCYCLES_USE_CLOCK)
+    return cpucycles_clock();
+#elif defined(__i386__) || defined(__x86_64__)
+    /* rdtscp waits for the code under test, and lfence keeps later
+     * instructions from starting before the counter is read.
+     */
+    unsigned int hi, lo;
+    __asm__ volatile("rdtscp\n\tlfence" : "=a"(lo), "=d"(hi)::"ecx", "memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
 #else
-#error Unsupported Architecture
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val)::"memory");
+    return val;
 #endif
 }
 
+/* Cost of an empty timed region, to be subtracted from measurements.  The
+ * minimum over many runs excludes interrupts and cold caches.
+ */
+static inline int64_t cpucycles_overhead(void)
+{
+    int64_t min = INT64_MAX;
+    for (int i = 0; i < 10000; i++) {
+        int64_t begin = cpucycles_begin();
+        int64_t end = cpucycles_end();
+        if (end - begin < min)
+            min = end - begin;
+    }
+    return min;
+}
+
 #endif
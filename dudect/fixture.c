@@ -15,8 +15,10 @@
  *    by the OS.) Setting a threshold value for this is not obvious; we just
  *    keep the x% percent fastest timings, and repeat for several values of x.
  *
- *  - the previous observation is highly heuristic. We also keep the uncropped
- *    measurement time and do a t-test on that.
+ *  - the previous observation is highly heuristic. We also do a t-test on
+ *    nearly all measurements, leaving out only the slowest 5% or so of each
+ *    batch: a single interrupted execution is slow enough to swamp the
+ *    difference between the classes.
  *
  *  - we also test for unequal variances (second order test), but this is
  *    probably redundant since we're doing as well a t-test on cropped
@@ -26,24 +28,59 @@
  *    variable time.
  */
 
+/* Needed for the CPU affinity interface of sched.h */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "../console.h"
+#include "../histogram.h"
 #include "../random.h"
 
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "../harness.h"
+
 #include "constant.h"
+#include "cpucycles.h"
 #include "fixture.h"
 #include "ttest.h"
 
 #define ENOUGH_MEASURE 10000
 #define TEST_TRIES 10
 
-static t_context_t *t_ctxs[N_TESTS];
+/* Upper bound of measurement threads */
+#define MAX_THREADS 64
+
+/* Index of about the 95th percentile in the percentiles of a batch */
+#define CROP_PERCENTILE 42
+
+/* Batches measured before sequential mode may stop early */
+#define SEQUENTIAL_MIN_BATCHES 10
+
+/* Number of threads running measurement batches in parallel */
+int dudect_threads = 1;
+
+/* Stop as soon as the verdict is clear instead of after a fixed count */
+int dudect_sequential = 0;
+
+static t_context_t t_ctxs[N_TESTS];
+
+/* Cost of the counter reads around each measurement, calibrated per test */
+static int64_t ticks_overhead;
+
+/* Execution times of each input class, dumped to hist_file if it is set */
+static hist_t t_hists[2];
+static FILE *hist_file;
 
 /* threshold values for Welch's t-test */
 enum {
@@ -61,13 +98,21 @@ static void differentiate(int64_t *exec_times,
                           const int64_t *after_ticks)
 {
     for (size_t i = 0; i < N_MEASURES; i++)
-        exec_times[i] = after_ticks[i] - before_ticks[i];
+        exec_times[i] = after_ticks[i] - before_ticks[i] - ticks_overhead;
 }
 
-static void update_statistics(const int64_t *exec_times,
+static void update_statistics(t_context_t *ctxs,
+                              const int64_t *exec_times,
                               uint8_t *classes,
                               int64_t *percentiles)
 {
+    /* An interrupt or a cold cache after a context switch makes a few
+     * measurements thousands of times slower, enough to hide any difference
+     * between the classes, so even the first test leaves out the slowest
+     * measurements of the batch.
+     */
+    int64_t crop = percentiles[CROP_PERCENTILE];
+
     for (size_t i = DROP_SIZE; i < N_MEASURES; i++) {
         int64_t difference = exec_times[i];
         /* CPU cycle counter overflowed or dropped measurement */
@@ -75,11 +120,12 @@ static void update_statistics(const int64_t *exec_times,
             continue;
 
         /* do a t-test on the execution time */
-        t_push(t_ctxs[0], difference, classes[i]);
+        if (difference <= crop)
+            t_push(&ctxs[0], difference, classes[i]);
 
         for (size_t j = 0; j < N_PERCENTILES; j++) {
             if (difference < percentiles[j])
-                t_push(t_ctxs[j + 1], difference, classes[i]);
+                t_push(&ctxs[j + 1], difference, classes[i]);
         }
     }
 }
@@ -89,15 +135,15 @@ static t_context_t *max_test(void)
     size_t ret = 0;
     double max = 0;
     for (size_t i = 0; i < N_TESTS; i++) {
-        if (t_ctxs[i]->n[0] > ENOUGH_MEASURE) {
-            double x = fabs(t_compute(t_ctxs[i]));
+        if (t_ctxs[i].n[0] > ENOUGH_MEASURE) {
+            double x = fabs(t_compute(&t_ctxs[i]));
             if (max < x) {
                 max = x;
                 ret = i;
             }
         }
     }
-    return t_ctxs[ret];
+    return &t_ctxs[ret];
 }
 
 static bool report(void)
@@ -140,63 +186,259 @@ static bool report(void)
     return true;
 }
 
-static bool doit(int mode)
+/* Count the execution times of each class, before prepare_percentiles()
+ * reorders them
+ */
+static void record_histograms(hist_t *hists,
+                              const int64_t *exec_times,
+                              const uint8_t *classes)
+{
+    for (size_t i = DROP_SIZE; i < N_MEASURES; i++) {
+        if (exec_times[i] > 0)
+            hist_record(&hists[classes[i]], exec_times[i]);
+    }
+}
+
+/* Buffers of one batch, allocated once per test */
+typedef struct {
+    int64_t before_ticks[N_MEASURES + 1];
+    int64_t after_ticks[N_MEASURES + 1];
+    int64_t exec_times[N_MEASURES];
+    uint8_t classes[N_MEASURES];
+    uint8_t input_data[N_MEASURES * CHUNK_SIZE];
+    int64_t percentiles[N_PERCENTILES];
+} batch_t;
+
+/* Measure one batch and add it to the statistics in ctxs */
+static bool measure_batch(int mode,
+                          t_context_t *ctxs,
+                          hist_t *hists,
+                          batch_t *b)
+{
+    prepare_inputs(b->input_data, b->classes);
+    bool ret = measure(b->before_ticks, b->after_ticks, b->input_data, mode);
+    differentiate(b->exec_times, b->before_ticks, b->after_ticks);
+    record_histograms(hists, b->exec_times, b->classes);
+    prepare_percentiles(b->exec_times, b->percentiles);
+    update_statistics(ctxs, b->exec_times, b->classes, b->percentiles);
+    return ret;
+}
+
+typedef struct {
+    pthread_t thread;
+    int mode;
+    int cpu; /* CPU the thread is pinned to, or -1 */
+    int batches;
+    bool ok;
+    t_context_t ctxs[N_TESTS];
+    hist_t hists[2];
+    batch_t batch;
+} worker_t;
+
+static void *worker_run(void *arg)
+{
+    worker_t *w = arg;
+    /* The queues measured here are of no concern to other threads */
+    harness_thread_init(false);
+#if defined(__linux__)
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+#endif
+    init_dut();
+    for (size_t i = 0; i < N_TESTS; ++i)
+        t_init(&w->ctxs[i]);
+    hist_init(&w->hists[0]);
+    hist_init(&w->hists[1]);
+    w->ok = true;
+    for (int i = 0; i < w->batches; ++i)
+        w->ok &= measure_batch(w->mode, w->ctxs, w->hists, &w->batch);
+    return NULL;
+}
+
+/* Split the batches over dudect_threads threads, each pinned to its own CPU
+ * and keeping its own statistics, and merge the statistics when all are done.
+ * Return the number of batches measured, or 0 if no thread could be started.
+ */
+static int doit_parallel(int mode, int batches, bool *ok)
 {
-    int64_t *before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
-    int64_t *after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
-    int64_t *exec_times = calloc(N_MEASURES, sizeof(int64_t));
-    uint8_t *classes = calloc(N_MEASURES, sizeof(uint8_t));
-    uint8_t *input_data = calloc(N_MEASURES * CHUNK_SIZE, sizeof(uint8_t));
-    int64_t *percentiles = calloc(N_PERCENTILES, sizeof(int64_t));
-
-    if (!before_ticks || !after_ticks || !exec_times || !classes ||
-        !input_data || !percentiles) {
+    int cpus[MAX_THREADS];
+    int n_cpus = 0;
+#if defined(__linux__)
+    cpu_set_t set;
+    if (!sched_getaffinity(0, sizeof(set), &set)) {
+        for (int c = 0; c < CPU_SETSIZE && n_cpus < MAX_THREADS; c++) {
+            if (CPU_ISSET(c, &set))
+                cpus[n_cpus++] = c;
+        }
+    }
+#endif
+    int n = dudect_threads;
+    if (n > MAX_THREADS)
+        n = MAX_THREADS;
+    /* Threads sharing a CPU would disturb each other's measurements */
+    if (n_cpus && n > n_cpus)
+        n = n_cpus;
+    if (n < 2)
+        return 0;
+
+    worker_t *workers = calloc(n, sizeof(worker_t));
+    if (!workers)
         die();
+
+    int started = 0;
+    for (int i = 0; i < n; i++) {
+        worker_t *w = &workers[i];
+        w->mode = mode;
+        w->cpu = n_cpus ? cpus[i] : -1;
+        w->batches = (batches + n - 1) / n;
+        if (pthread_create(&w->thread, NULL, worker_run, w))
+            break;
+        started++;
     }
 
-    prepare_inputs(input_data, classes);
-    bool ret = measure(before_ticks, after_ticks, input_data, mode);
-    differentiate(exec_times, before_ticks, after_ticks);
-    prepare_percentiles(exec_times, percentiles);
-    update_statistics(exec_times, classes, percentiles);
-    ret &= report();
+    *ok = true;
+    for (int i = 0; i < started; i++) {
+        worker_t *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        *ok &= w->ok;
+        for (size_t j = 0; j < N_TESTS; ++j)
+            t_merge(&t_ctxs[j], &w->ctxs[j]);
+        hist_merge(&t_hists[0], &w->hists[0]);
+        hist_merge(&t_hists[1], &w->hists[1]);
+    }
+    free(workers);
+    return started * ((batches + n - 1) / n);
+}
 
-    free(before_ticks);
-    free(after_ticks);
-    free(exec_times);
-    free(classes);
-    free(input_data);
-    free(percentiles);
+/* Verdicts of sequential mode */
+enum {
+    verdict_certain = -2, /* not constant time, whatever the other tries say */
+    verdict_failed = -1,  /* not constant time in this try */
+    verdict_none = 0,     /* keep measuring */
+    verdict_passed = 1,   /* constant time */
+};
 
-    return ret;
+/* Decide early in sequential mode, once SEQUENTIAL_MIN_BATCHES batches are
+ * in.  A t above the threshold is already significant then, but a small t
+ * says little about a leak that only shows with more measurements, so the
+ * code is not declared constant time before ENOUGH_MEASURE of them.
+ */
+static int sequential_verdict(void)
+{
+    t_context_t *t = max_test();
+    double max_t = fabs(t_compute(t));
+    if (max_t > t_threshold_bananas)
+        return verdict_certain;
+    if (max_t > t_threshold_moderate)
+        return verdict_failed;
+    if (t->n[0] + t->n[1] >= ENOUGH_MEASURE)
+        return verdict_passed;
+    return verdict_none;
 }
 
 static void init_once(void)
 {
     init_dut();
+    ticks_overhead = cpucycles_overhead();
     for (size_t i = 0; i < N_TESTS; ++i)
-        t_init(t_ctxs[i]);
+        t_init(&t_ctxs[i]);
+    hist_init(&t_hists[0]);
+    hist_init(&t_hists[1]);
+}
+
+bool dudect_set_histfile(char *file_name)
+{
+    if (hist_file)
+        fclose(hist_file);
+    hist_file = NULL;
+    if (!file_name)
+        return true;
+    hist_file = fopen(file_name, "w");
+    return hist_file != NULL;
+}
+
+/* Write the execution times of the last try as one line per bucket that is
+ * not empty for both classes: bucket bounds in cycles, then the count of
+ * each class.
+ */
+static void dump_histograms(char *text, bool result)
+{
+    t_context_t *t = max_test();
+    fprintf(hist_file, "# %s: %.0f measurements, max t %.2f, %s\n", text,
+            t_ctxs[0].n[0] + t_ctxs[0].n[1], fabs(t_compute(t)),
+            result ? "constant time" : "not constant time");
+    fprintf(hist_file, "# low high class0 class1\n");
+    uint64_t low = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t high = hist_bucket_upper(i);
+        if (t_hists[0].bucket[i] || t_hists[1].bucket[i]) {
+            fprintf(hist_file, "%lu %lu %lu %lu\n", (unsigned long) low,
+                    (unsigned long) high, (unsigned long) t_hists[0].bucket[i],
+                    (unsigned long) t_hists[1].bucket[i]);
+        }
+        low = high + 1;
+    }
+    /* Separate the data sets of different tests for plotting tools */
+    fprintf(hist_file, "\n\n");
+    fflush(hist_file);
 }
 
 static bool test_const(char *text, int mode)
 {
     bool result = false;
-    for (size_t i = 0; i < N_TESTS; ++i)
-        t_ctxs[i] = malloc(sizeof(t_context_t));
+    int batches = ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
+    batch_t *batch = malloc(sizeof(batch_t));
+    if (!batch)
+        die();
+
+    double used = 0;
 
     for (int cnt = 0; cnt < TEST_TRIES; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, TEST_TRIES);
         init_once();
-        for (int i = 0; i < ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
-             ++i)
-            result = doit(mode);
+        bool ok = true;
+        int done = 0, verdict = verdict_none;
+        while (done < batches && verdict == verdict_none) {
+            /* Sequential mode checks after every batch of every thread */
+            int step = dudect_sequential ? 1 : batches - done;
+            int n = 0;
+            if (dudect_threads > 1) {
+                bool round_ok;
+                n = doit_parallel(
+                    mode, dudect_sequential ? dudect_threads : step, &round_ok);
+                if (n) {
+                    ok &= round_ok;
+                    result = report() && ok;
+                }
+            }
+            if (!n) {
+                for (; n < step; n++) {
+                    ok &= measure_batch(mode, t_ctxs, t_hists, batch);
+                    result = report() && ok;
+                }
+            }
+            done += n;
+            if (dudect_sequential && done >= SEQUENTIAL_MIN_BATCHES)
+                verdict = sequential_verdict();
+        }
+        if (verdict != verdict_none)
+            result = verdict == verdict_passed && ok;
+        used += t_ctxs[0].n[0] + t_ctxs[0].n[1];
         printf("\033[A\033[2K\033[A\033[2K");
-        if (result)
+        /* Another try could only repeat a failure that far off */
+        if (result || verdict == verdict_certain)
             break;
     }
 
-    for (size_t i = 0; i < N_TESTS; ++i)
-        free(t_ctxs[i]);
+    if (dudect_sequential)
+        printf("Decided after %.0f measurements\n", used);
+    if (hist_file)
+        dump_histograms(text, result);
+    free(batch);
     return result;
 }
 
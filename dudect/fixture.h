@@ -4,6 +4,17 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Number of threads running measurements, 1 for serial measurement */
+extern int dudect_threads;
+
+/* Nonzero to stop measuring as soon as the verdict is clear */
+extern int dudect_sequential;
+
+/* Write per-class histograms of execution times of every test to file_name,
+ * or stop writing them if it is NULL.  Return false if it cannot be opened.
+ */
+bool dudect_set_histfile(char *file_name);
+
 /* Interface to test if function is constant */
 #define _(x) bool is_##x##_const(void);
 DUT_FUNCS
@@ -1,5 +1,6 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
@@ -40,33 +41,72 @@ typedef struct __block_element {
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+typedef struct {
+    block_element_t *head;
+    size_t count;
+} block_list_t;
+
+/* Blocks of the queues of qtest.  Once threads share them, as web workers
+ * do, the list is only used under shared_lock.
+ */
+static block_list_t shared_blocks;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool shared_locking = false;
+
+/* Threads measuring in simulation mode keep their own list, so that they
+ * neither race with each other nor see the queues of qtest.
+ */
+static __thread block_list_t private_blocks;
+static __thread bool private_thread = false;
+
+/* Is this a thread other than the main one? */
+static __thread bool in_thread = false;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
 static bool cautious_mode = true;
-static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+static __thread bool noallocate_mode = false;
+static __thread bool error_occurred = false;
+static __thread char *error_message = "";
 
 static int time_limit = 1;
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+/* Data for managing exceptions, which are raised in the thread that failed */
+static __thread sigjmp_buf env;
+static __thread volatile sig_atomic_t jmp_ready = false;
+static __thread bool time_limited = false;
 
 /* Internal functions */
 
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
+    if (!fail_probability)
+        return false;
     double weight = (double) random() / RAND_MAX;
     return (weight < 0.01 * fail_probability);
 }
 
+/* Take the list of blocks of this thread, locking it if it is shared */
+static block_list_t *lock_blocks(bool *locked)
+{
+    if (private_thread) {
+        *locked = false;
+        return &private_blocks;
+    }
+    *locked = shared_locking;
+    if (*locked)
+        pthread_mutex_lock(&shared_lock);
+    return &shared_blocks;
+}
+
+static void unlock_blocks(bool locked)
+{
+    if (locked)
+        pthread_mutex_unlock(&shared_lock);
+}
+
 /* Find header of block, given its payload.
  * Signal error if doesn't seem like legitimate block
  */
@@ -81,12 +121,15 @@ static block_element_t *find_header(void *p)
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
+        bool locked;
+        block_list_t *blocks = lock_blocks(&locked);
+        block_element_t *ab = blocks->head;
         bool found = false;
         while (ab && !found) {
             found = ab == b;
             ab = ab->next;
         }
+        unlock_blocks(locked);
         if (!found) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
@@ -143,15 +186,19 @@ void *test_malloc(size_t size)
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, FILLCHAR, size);
+
+    bool locked;
+    block_list_t *blocks = lock_blocks(&locked);
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
+    new_block->next = blocks->head;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->prev = NULL;
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    if (blocks->head)
+        blocks->head->prev = new_block;
+    blocks->head = new_block;
+    blocks->count++;
+    unlock_blocks(locked);
 
     return p;
 }
@@ -191,18 +238,23 @@ void test_free(void *p)
     *find_footer(b) = MAGICFREE;
     memset(p, FILLCHAR, b->payload_size);
 
-    /* Unlink from list */
+    /* Unlink from list.  Only list operations hold the lock, since the
+     * checks above may fault on a bad pointer.
+     */
+    bool locked;
+    block_list_t *blocks = lock_blocks(&locked);
     block_element_t *bn = b->next;
     block_element_t *bp = b->prev;
     if (bp)
         bp->next = bn;
     else
-        allocated = bn;
+        blocks->head = bn;
     if (bn)
         bn->prev = bp;
+    blocks->count--;
+    unlock_blocks(locked);
 
     free(b);
-    allocated_count--;
 }
 
 // cppcheck-suppress unusedFunction
@@ -218,17 +270,28 @@ char *test_strdup(const char *s)
 
 size_t allocation_check()
 {
-    return allocated_count;
+    return private_thread ? private_blocks.count : shared_blocks.count;
+}
+
+void harness_thread_init(bool share)
+{
+    in_thread = true;
+    private_thread = !share;
+    if (share)
+        shared_locking = true;
 }
 
 /* Implementation of functions for testing */
 
 /* Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
+ * Returns the previous mode, so that callers can restore it.
  */
-void set_cautious_mode(bool cautious)
+bool set_cautious_mode(bool cautious)
 {
+    bool old = cautious_mode;
     cautious_mode = cautious;
+    return old;
 }
 
 /* Set/unset restricted allocation mode.
@@ -268,7 +331,7 @@ bool exception_setup(bool limit_time)
 
     /* Got here from initial call */
     jmp_ready = true;
-    if (limit_time) {
+    if (limit_time && !in_thread) {
         alarm(time_limit);
         time_limited = true;
     }
@@ -21,14 +21,23 @@ char *test_strdup(const char *s);
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Prepare the calling thread, which is not the main one, to run queue code.
+ * With share set, its blocks are those of the main thread, and from now on
+ * every thread takes a lock to use them; it must not be called while queue
+ * code runs elsewhere.  Otherwise the thread keeps its blocks to itself.
+ * Time limits only apply in the main thread, which receives SIGALRM.
+ */
+void harness_thread_init(bool share);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
+ * Returns the previous mode.
  */
-void set_cautious_mode(bool cautious);
+bool set_cautious_mode(bool cautious);
 
 /*
  * Set/unset restricted allocation mode.
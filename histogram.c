@@ -0,0 +1,75 @@
+#include <string.h>
+
+#include "histogram.h"
+
+static inline int hist_index(uint64_t v)
+{
+    if (v < HIST_SUB_BUCKETS)
+        return (int) v;
+
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS;
+    int sub = (int) (v >> shift) & (HIST_SUB_BUCKETS - 1);
+    return (shift + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+uint64_t hist_bucket_upper(int i)
+{
+    if (i < HIST_SUB_BUCKETS)
+        return (uint64_t) i;
+
+    int shift = i / HIST_SUB_BUCKETS - 1;
+    uint64_t sub = (uint64_t) (i % HIST_SUB_BUCKETS) + HIST_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void hist_init(hist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void hist_record(hist_t *h, uint64_t v)
+{
+    h->bucket[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+}
+
+uint64_t hist_percentile(const hist_t *h, double p)
+{
+    if (!h->count)
+        return 0;
+
+    uint64_t rank = (uint64_t) (p * h->count);
+    if (rank < 1)
+        rank = 1;
+    if (rank > h->count)
+        rank = h->count;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank) {
+            uint64_t v = hist_bucket_upper(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+void hist_merge(hist_t *dst, const hist_t *src)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->bucket[i] += src->bucket[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
@@ -0,0 +1,43 @@
+#ifndef LAB0_HISTOGRAM_H
+#define LAB0_HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Log-linear histogram in the style of HdrHistogram.
+ *
+ * Values below HIST_SUB_BUCKETS are counted exactly.  Larger values are
+ * grouped by their most significant bit, and each group is split into
+ * HIST_SUB_BUCKETS linear buckets, so any recorded value is known to within
+ * 1/HIST_SUB_BUCKETS of itself.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum; /* of all values recorded */
+    uint64_t min;
+    uint64_t max;
+    uint64_t bucket[HIST_BUCKETS];
+} hist_t;
+
+void hist_init(hist_t *h);
+
+/* Count one occurrence of value v */
+void hist_record(hist_t *h, uint64_t v);
+
+/* Smallest value v such that a fraction p (0..1) of recorded values are at
+ * most v, to the precision of the histogram.  Return 0 for empty histogram.
+ */
+uint64_t hist_percentile(const hist_t *h, double p);
+
+/* Add the counts of src to dst */
+void hist_merge(hist_t *dst, const hist_t *src);
+
+/* Largest value counted in bucket i.  Bucket i covers the values from
+ * hist_bucket_upper(i - 1) + 1, or 0 for the first bucket, up to this.
+ */
+uint64_t hist_bucket_upper(int i);
+
+#endif /* LAB0_HISTOGRAM_H */
@@ -0,0 +1,144 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "perfcount.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perf_attrs[N_PERF_EVENTS] = {
+    [PERF_cycles] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_instructions] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_l1d_read_misses] = {PERF_TYPE_HW_CACHE,
+                              PERF_COUNT_HW_CACHE_L1D |
+                                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    [PERF_llc_misses] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [PERF_branch_misses] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+/* The first counter opened leads the group */
+static int perf_leader(const perf_counters_t *pc)
+{
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+        if (pc->fd[i] >= 0)
+            return pc->fd[i];
+    }
+    return -1;
+}
+
+bool perf_open(perf_counters_t *pc)
+{
+    int leader = -1;
+    pc->enabled = pc->running = 0;
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_attrs[i].type;
+        attr.config = perf_attrs[i].config;
+        attr.disabled = 1;
+        /* Count only this process in user space, which needs no privilege */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP |
+                           PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        /* An event the group has no room for is left out */
+        pc->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        pc->value[i] = 0;
+        if (leader < 0)
+            leader = pc->fd[i];
+    }
+    return leader >= 0;
+}
+
+void perf_start(perf_counters_t *pc)
+{
+    int leader = perf_leader(pc);
+    if (leader < 0)
+        return;
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+void perf_stop(perf_counters_t *pc)
+{
+    int leader = perf_leader(pc);
+    if (leader < 0)
+        return;
+    ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    /* Number of counters, times enabled and running, then the counters in
+     * the order they joined the group
+     */
+    uint64_t buf[3 + N_PERF_EVENTS];
+    ssize_t n = read(leader, buf, sizeof(buf));
+    pc->enabled = pc->running = 0;
+    if (n < (ssize_t) (3 * sizeof(uint64_t)) ||
+        n < (ssize_t) ((3 + buf[0]) * sizeof(uint64_t))) {
+        for (int i = 0; i < N_PERF_EVENTS; i++)
+            pc->value[i] = 0;
+        return;
+    }
+    pc->enabled = buf[1];
+    pc->running = buf[2];
+
+    uint64_t *v = buf + 3;
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+        if (pc->fd[i] < 0)
+            continue;
+        uint64_t count = *v++;
+        if (!pc->running)
+            pc->value[i] = 0;
+        else if (pc->running < pc->enabled)
+            pc->value[i] =
+                (uint64_t) ((double) count * pc->enabled / pc->running);
+        else
+            pc->value[i] = count;
+    }
+}
+
+void perf_close(perf_counters_t *pc)
+{
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+        if (pc->fd[i] >= 0)
+            close(pc->fd[i]);
+        pc->fd[i] = -1;
+    }
+}
+
+#else /* No performance counters */
+
+bool perf_open(perf_counters_t *pc)
+{
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+        pc->fd[i] = -1;
+        pc->value[i] = 0;
+    }
+    pc->enabled = pc->running = 0;
+    return false;
+}
+
+void perf_start(perf_counters_t *pc) {}
+
+void perf_stop(perf_counters_t *pc) {}
+
+void perf_close(perf_counters_t *pc) {}
+
+#endif
+
+const char *perf_event_name(int i)
+{
+    static const char *names[N_PERF_EVENTS] = {
+#define _(x) #x,
+        PERF_EVENTS
+#undef _
+    };
+    return i >= 0 && i < N_PERF_EVENTS ? names[i] : "unknown";
+}
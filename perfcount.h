@@ -0,0 +1,58 @@
+#ifndef LAB0_PERFCOUNT_H
+#define LAB0_PERFCOUNT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hardware performance counters around a stretch of code.
+ *
+ * Uses perf_event_open on Linux.  Counters the kernel or CPU does not offer
+ * (e.g. inside a virtual machine, or with a restrictive
+ * perf_event_paranoid) are simply marked unavailable; elsewhere none are.
+ * The available ones form a group, which the kernel schedules as a whole,
+ * so that all of them count over the same time.
+ */
+
+#define PERF_EVENTS     \
+    _(cycles)           \
+    _(instructions)     \
+    _(l1d_read_misses)  \
+    _(llc_misses)       \
+    _(branch_misses)
+
+enum {
+#define _(x) PERF_##x,
+    PERF_EVENTS
+#undef _
+};
+
+#define N_PERF_EVENTS (PERF_branch_misses + 1)
+
+typedef struct {
+    int fd[N_PERF_EVENTS]; /* -1 when event is unavailable */
+    uint64_t value[N_PERF_EVENTS];
+    /* When other users of the counters left the group only part of the
+     * time, running < enabled and the values are scaled up to enabled.
+     */
+    uint64_t enabled, running;
+} perf_counters_t;
+
+/* Open all counters, initially stopped.
+ * Return false if none of them is available.
+ */
+bool perf_open(perf_counters_t *pc);
+
+/* Reset and start counting */
+void perf_start(perf_counters_t *pc);
+
+/* Stop counting and read the counts into value[], scaled for the time the
+ * group was not counting
+ */
+void perf_stop(perf_counters_t *pc);
+
+void perf_close(perf_counters_t *pc);
+
+/* Printable name of event i */
+const char *perf_event_name(int i);
+
+#endif /* LAB0_PERFCOUNT_H */
@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -19,6 +21,7 @@
 #include <time.h>
 #endif
 
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 #include "list.h"
 #include "random.h"
@@ -65,7 +68,37 @@ typedef struct {
 } queue_chain_t;
 
 static queue_chain_t chain = {.size = 0};
-static queue_contex_t *current = NULL;
+
+/* A queue of the chain and the lock held while a command runs on it.  The
+ * lock is kept out of queue_contex_t, which queue.h defines for q_merge.
+ * The context comes first, so freeing it frees the whole.
+ */
+typedef struct {
+    queue_contex_t ctx;
+    pthread_mutex_t lock;
+} locked_queue_t;
+
+static pthread_mutex_t *queue_lock(queue_contex_t *qctx)
+{
+    return &container_of(qctx, locked_queue_t, ctx)->lock;
+}
+
+/* Each thread running commands, such as a web worker, has a current queue
+ * of its own.  Commands on the current queue hold chain_lock for reading
+ * and the lock of the queue, so that those on different queues run
+ * concurrently, while commands on the chain hold chain_lock for writing.
+ */
+static __thread queue_contex_t *current = NULL;
+static pthread_rwlock_t chain_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Bumped whenever queues are freed, telling other threads to check that
+ * their current queue is still there.
+ */
+static unsigned long chain_gen = 0;
+static __thread unsigned long current_gen = 0;
+
+/* Has this thread been prepared to run queue code? */
+static __thread bool thread_ready = false;
 
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST_SIZE;
@@ -86,6 +119,25 @@ typedef enum {
 /* Forward declarations */
 static bool q_show(int vlevel);
 
+/* Run the dudect test of an operation in simulation mode */
+static bool simulate(int argc, char *argv[], bool (*is_const)(void))
+{
+    if (argc != 1) {
+        report(1, "%s does not need arguments in simulation mode", argv[0]);
+        return false;
+    }
+    /* Skip the linear search of cautious mode when freeing large queues */
+    bool cautious = set_cautious_mode(false);
+    bool ok = is_const();
+    set_cautious_mode(cautious);
+    if (!ok) {
+        report(1, "ERROR: Probably not constant time or wrong implementation");
+        return false;
+    }
+    report(1, "Probably constant time");
+    return true;
+}
+
 static bool do_free(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -120,8 +172,10 @@ static bool do_free(int argc, char *argv[])
     }
 
     if (current) {
+        pthread_mutex_destroy(queue_lock(current));
         free(current);
         chain.size--;
+        chain_gen++;
         current = qnext ? list_entry(qnext, queue_contex_t, chain) : NULL;
     }
 
@@ -148,12 +202,14 @@ static bool do_new(int argc, char *argv[])
     bool ok = true;
 
     if (exception_setup(true)) {
-        queue_contex_t *qctx = malloc(sizeof(queue_contex_t));
+        locked_queue_t *lq = malloc(sizeof(locked_queue_t));
+        queue_contex_t *qctx = &lq->ctx;
         list_add_tail(&qctx->chain, &chain.head);
 
         qctx->size = 0;
         qctx->q = q_new();
         qctx->id = chain.size++;
+        pthread_mutex_init(&lq->lock, NULL);
 
         current = qctx;
     }
@@ -182,19 +238,9 @@ static void fill_rand_string(char *buf, size_t buf_size)
 static bool queue_insert(position_t pos, int argc, char *argv[])
 {
     if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok =
-            pos == POS_TAIL ? is_insert_tail_const() : is_insert_head_const();
-        if (!ok) {
-            report(1,
-                   "ERROR: Probably not constant time or wrong implementation");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
+        return simulate(argc, argv,
+                        pos == POS_TAIL ? is_insert_tail_const
+                                        : is_insert_head_const);
     }
 
     char *lasts = NULL;
@@ -294,19 +340,9 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
      */
 #if !(defined(__aarch64__) && defined(__APPLE__))
     if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok =
-            pos == POS_TAIL ? is_remove_tail_const() : is_remove_head_const();
-        if (!ok) {
-            report(1,
-                   "ERROR: Probably not constant time or wrong implementation");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
+        return simulate(argc, argv,
+                        pos == POS_TAIL ? is_remove_tail_const
+                                        : is_remove_head_const);
     }
 #endif
 
@@ -512,6 +548,9 @@ static bool do_dedup(int argc, char *argv[])
 
 static bool do_reverse(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, is_reverse_const);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -533,6 +572,9 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, is_size_const);
+
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
@@ -581,6 +623,9 @@ static bool do_size(int argc, char *argv[])
 
 bool do_sort(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, is_sort_const);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -631,6 +676,9 @@ bool do_sort(int argc, char *argv[])
 
 static bool do_dm(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, is_delete_mid_const);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -696,6 +744,9 @@ static bool do_shuffle(int argc, char *argv[])
 
 static bool do_swap(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, is_swap_const);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -845,6 +896,9 @@ static bool do_reverseK(int argc, char *argv[])
 
 static bool do_merge(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, is_merge_const);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -873,8 +927,10 @@ static bool do_merge(int argc, char *argv[])
             queue_contex_t *ctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
             q_free(ctx->q);
+            pthread_mutex_destroy(queue_lock(ctx));
             free(ctx);
         }
+        chain_gen++;
 
         chain.head.prev = &current->chain;
         current->chain.next = &chain.head;
@@ -914,6 +970,301 @@ static bool do_merge(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Empirical complexity estimation.
+ *
+ * An operation is timed on private queues of size 2^CPLX_MIN_SHIFT up to
+ * 2^CPLX_MAX_SHIFT, keeping the fastest of CPLX_REPS runs at each size, and
+ * the slope b of log(time) against log(n) is fitted, so that time ~ n^b.
+ * Each run starts with the queue evicted from the private caches, since a
+ * queue that still fits there is faster per element than one that does not,
+ * which made linear operations look like O(n log n).  The log factor is
+ * within the noise of b, so only O(1), O(n) and O(n^2) are told apart, by
+ * the bands of b below: O(log n) counts as O(1) and O(n log n) as O(n).
+ */
+#define CPLX_MIN_SHIFT 8
+#define CPLX_MAX_SHIFT 14
+#define CPLX_POINTS (CPLX_MAX_SHIFT - CPLX_MIN_SHIFT + 1)
+#define CPLX_REPS 15
+#define CPLX_STRLEN 8
+/* Bytes written between runs to evict the queue from the private caches */
+#define CPLX_SCRUB (8 << 20)
+
+typedef enum { CPLX_1, CPLX_N, CPLX_N2, N_CPLX } cplx_model_t;
+static const char *cplx_names[N_CPLX] = {"1", "n", "n2"};
+static const char *cplx_desc[N_CPLX] = {"O(1)", "O(n)", "O(n^2)"};
+/* Largest slope b of each model but the last */
+static const double cplx_bound[N_CPLX - 1] = {0.7, 1.6};
+
+/* Second queue used by merge */
+static struct list_head *cplx_other;
+
+static void cplx_fill(struct list_head *q, int n)
+{
+    char buf[CPLX_STRLEN + 1];
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < CPLX_STRLEN; j++)
+            buf[j] = charset[rand() % (sizeof(charset) - 1)];
+        buf[CPLX_STRLEN] = '\0';
+        q_insert_tail(q, buf);
+    }
+}
+
+static void cplx_fill_dup(struct list_head *q, int n)
+{
+    cplx_fill(q, n / 2);
+    /* Every value appears twice once the queue is sorted */
+    element_t *e;
+    int cnt = n / 2;
+    list_for_each_entry (e, q, list) {
+        if (!cnt--)
+            break;
+        q_insert_tail(q, e->value);
+    }
+    q_sort(q, false);
+}
+
+static void cplx_fill_merge(struct list_head *q, int n)
+{
+    cplx_fill(q, n / 2);
+    q_sort(q, false);
+    cplx_other = q_new();
+    cplx_fill(cplx_other, n - n / 2);
+    q_sort(cplx_other, false);
+}
+
+static void cplx_ih(struct list_head *q)
+{
+    q_insert_head(q, "complexity");
+}
+
+static void cplx_it(struct list_head *q)
+{
+    q_insert_tail(q, "complexity");
+}
+
+static void cplx_rh(struct list_head *q)
+{
+    q_release_element(q_remove_head(q, NULL, 0));
+}
+
+static void cplx_rt(struct list_head *q)
+{
+    q_release_element(q_remove_tail(q, NULL, 0));
+}
+
+static void cplx_size(struct list_head *q)
+{
+    q_size(q);
+}
+
+static void cplx_dm(struct list_head *q)
+{
+    q_delete_mid(q);
+}
+
+static void cplx_dedup(struct list_head *q)
+{
+    q_delete_dup(q);
+}
+
+static void cplx_swap(struct list_head *q)
+{
+    q_swap(q);
+}
+
+static void cplx_reverse(struct list_head *q)
+{
+    q_reverse(q);
+}
+
+static void cplx_reverseK(struct list_head *q)
+{
+    q_reverseK(q, 3);
+}
+
+static void cplx_sort(struct list_head *q)
+{
+    q_sort(q, false);
+}
+
+static void cplx_ascend(struct list_head *q)
+{
+    q_ascend(q);
+}
+
+static void cplx_descend(struct list_head *q)
+{
+    q_descend(q);
+}
+
+static void cplx_merge(struct list_head *q)
+{
+    LIST_HEAD(head);
+    queue_contex_t ctx[2] = {{.q = q, .id = 0}, {.q = cplx_other, .id = 1}};
+    list_add_tail(&ctx[0].chain, &head);
+    list_add_tail(&ctx[1].chain, &head);
+    q_merge(&head, false);
+}
+
+typedef struct {
+    char *name;
+    void (*fill)(struct list_head *q, int n);
+    void (*run)(struct list_head *q);
+} cplx_op_t;
+
+static cplx_op_t cplx_ops[] = {
+    {"ih", cplx_fill, cplx_ih},
+    {"it", cplx_fill, cplx_it},
+    {"rh", cplx_fill, cplx_rh},
+    {"rt", cplx_fill, cplx_rt},
+    {"size", cplx_fill, cplx_size},
+    {"dm", cplx_fill, cplx_dm},
+    {"dedup", cplx_fill_dup, cplx_dedup},
+    {"swap", cplx_fill, cplx_swap},
+    {"reverse", cplx_fill, cplx_reverse},
+    {"reverseK", cplx_fill, cplx_reverseK},
+    {"sort", cplx_fill, cplx_sort},
+    {"ascend", cplx_fill, cplx_ascend},
+    {"descend", cplx_fill, cplx_descend},
+    {"merge", cplx_fill_merge, cplx_merge},
+};
+
+/* Least squares slope of log(ticks) against log(sizes) */
+static double cplx_slope(const int *sizes, const double *ticks, int cnt)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i = 0; i < cnt; i++) {
+        double x = log2(sizes[i]), y = log2(ticks[i]);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    return (cnt * sxy - sx * sy) / (cnt * sxx - sx * sx);
+}
+
+static bool do_complexity(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    cplx_op_t *op = NULL;
+    for (size_t i = 0; i < sizeof(cplx_ops) / sizeof(cplx_ops[0]); i++) {
+        if (!strcmp(argv[1], cplx_ops[i].name))
+            op = &cplx_ops[i];
+    }
+    if (!op) {
+        report(1, "Unknown operation '%s'", argv[1]);
+        return false;
+    }
+
+    int limit = N_CPLX;
+    if (argc == 3) {
+        for (limit = 0; limit < N_CPLX; limit++) {
+            if (!strcmp(argv[2], cplx_names[limit]))
+                break;
+        }
+        if (limit == N_CPLX) {
+            report(1, "Unknown model '%s' (expected 1, n or n2)", argv[2]);
+            return false;
+        }
+    }
+
+    int sizes[CPLX_POINTS];
+    double ticks[CPLX_POINTS];
+    int cnt = 0;
+    bool timeout = false;
+    int64_t overhead = cpucycles_overhead();
+
+    volatile uint8_t *scrub = malloc(CPLX_SCRUB);
+    if (!scrub) {
+        report(1, "ERROR: Could not allocate memory to scrub caches");
+        return false;
+    }
+
+    /* Skip the linear search of cautious mode on every free */
+    bool cautious = set_cautious_mode(false);
+    for (int shift = CPLX_MIN_SHIFT; shift <= CPLX_MAX_SHIFT && !timeout;
+         shift++) {
+        int n = 1 << shift;
+        int64_t best = INT64_MAX;
+        for (int r = 0; r < CPLX_REPS && !timeout; r++) {
+            struct list_head *q = q_new();
+            op->fill(q, n);
+            /* Filling leaves as much of the queue in cache as fits */
+            for (size_t i = 0; i < CPLX_SCRUB; i += 64)
+                scrub[i]++;
+            volatile int64_t elapsed = 0;
+            volatile bool done = false;
+            if (exception_setup(true)) {
+                int64_t start = cpucycles_begin();
+                op->run(q);
+                elapsed = cpucycles_end() - start - overhead;
+                done = true;
+            }
+            exception_cancel();
+            if (exception_setup(true)) {
+                q_free(q);
+                if (cplx_other)
+                    q_free(cplx_other);
+            }
+            exception_cancel();
+            cplx_other = NULL;
+
+            if (!done)
+                timeout = true;
+            else if (elapsed < best)
+                best = elapsed;
+        }
+        if (timeout)
+            break;
+        sizes[cnt] = n;
+        /* Keep the fit away from zero after the overhead is subtracted */
+        ticks[cnt] = best > 0 ? (double) best : 1;
+        report(2, "n = %6d: %12.0f " CPUCYCLES_UNIT, n, ticks[cnt]);
+        cnt++;
+    }
+    set_cautious_mode(cautious);
+    free((void *) scrub);
+    error_check();
+
+    if (timeout)
+        report(1, "Operation '%s' timed out after %d sizes", op->name, cnt);
+    if (cnt < 3) {
+        report(1, "ERROR: Too few measurements to estimate complexity");
+        return false;
+    }
+
+    double slope = cplx_slope(sizes, ticks, cnt);
+    cplx_model_t fit = CPLX_1;
+    while (fit < N_CPLX - 1 && slope > cplx_bound[fit])
+        fit++;
+
+    report(1, "Estimated complexity of %s: %s (time ~ n^%.2f)", op->name,
+           cplx_desc[fit], slope);
+    if (argc == 3 && ((int) fit > limit || timeout)) {
+        report(1, "ERROR: Expected at most %s", cplx_desc[limit]);
+        return false;
+    }
+    return true;
+}
+
+static bool do_simhist(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!dudect_set_histfile(argv[1])) {
+        report(1, "Couldn't open histogram file '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
 static bool is_circular()
 {
     struct list_head *cur = current->q->next;
@@ -1051,6 +1402,93 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+/* Commands on the current queue only.  Outside simulation mode, they need
+ * no more than the lock of that queue.
+ */
+static const cmd_func_t queue_cmds[] = {
+    do_shuffle, do_ih,     do_it,      do_rh,       do_rt,
+    do_reverse, do_sort,   do_size,    do_dm,       do_dedup,
+    do_swap,    do_ascend, do_descend, do_reverseK,
+};
+
+/* Commands on the chain, or on state shared by every queue */
+static const cmd_func_t chain_cmds[] = {
+    do_new,  do_free,  do_prev,    do_next,
+    do_show, do_merge, do_simhist, do_complexity,
+};
+
+static bool cmd_in(cmd_func_t op, const cmd_func_t *cmds, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (cmds[i] == op)
+            return true;
+    }
+    return false;
+}
+
+/* Take or release the locks needed by a command.  The commands of the
+ * console itself need none.
+ */
+static void q_lock_cmd(cmd_func_t op, bool lock)
+{
+    /* Commands with locks do not nest, so one set is held at a time */
+    static __thread bool chain_held = false;
+    static __thread queue_contex_t *queue_held = NULL;
+
+    if (!lock) {
+        if (queue_held)
+            pthread_mutex_unlock(queue_lock(queue_held));
+        if (chain_held)
+            pthread_rwlock_unlock(&chain_lock);
+        chain_held = false;
+        queue_held = NULL;
+        return;
+    }
+
+    bool queue_cmd =
+        cmd_in(op, queue_cmds, sizeof(queue_cmds) / sizeof(queue_cmds[0]));
+    if (!queue_cmd &&
+        !cmd_in(op, chain_cmds, sizeof(chain_cmds) / sizeof(chain_cmds[0])))
+        return;
+    /* Simulation mode measures with the shared state of dudect */
+    bool on_queue = queue_cmd && !simulation;
+
+    if (!thread_ready) {
+        /* A web worker.  The main thread was prepared by q_init() */
+        pthread_rwlock_wrlock(&chain_lock);
+        harness_thread_init(true);
+        pthread_rwlock_unlock(&chain_lock);
+        thread_ready = true;
+    }
+
+    if (on_queue)
+        pthread_rwlock_rdlock(&chain_lock);
+    else
+        pthread_rwlock_wrlock(&chain_lock);
+    chain_held = true;
+
+    /* Another thread may have freed the current queue of this one, or
+     * created the first queue.  Like free does, move on to another queue
+     * then, so that there is a current queue whenever there are queues.
+     */
+    if (current_gen != chain_gen || !current) {
+        queue_contex_t *qctx, *found = NULL;
+        list_for_each_entry (qctx, &chain.head, chain) {
+            if (qctx == current)
+                found = qctx;
+        }
+        if (!found && !list_empty(&chain.head))
+            found = list_first_entry(&chain.head, queue_contex_t, chain);
+        current = found;
+        current_gen = chain_gen;
+    }
+
+    if (on_queue && current) {
+        pthread_mutex_lock(queue_lock(current));
+        queue_held = current;
+    }
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1092,6 +1530,14 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+    ADD_COMMAND(simhist,
+                "Write execution time histograms of each input class of "
+                "simulation tests to file",
+                "file");
+    ADD_COMMAND(complexity,
+                "Estimate time complexity of operation op on growing queues. "
+                "Fail if worse than model (1, n, n2)",
+                "op [model]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
@@ -1100,6 +1546,12 @@ static void console_init()
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("threads", &dudect_threads,
+              "Number of CPU-pinned threads measuring in simulation mode",
+              NULL);
+    add_param("sequential", &dudect_sequential,
+              "Stop simulation tests as soon as the result is conclusive",
+              NULL);
 }
 
 /* Signal handlers */
@@ -1121,9 +1573,25 @@ static void sigalrm_handler(int sig)
         "code is too inefficient");
 }
 
+/* Report queue state for machine-readable output.  Holding chain_lock for
+ * writing keeps commands on any queue from running meanwhile.
+ */
+static void q_state(long *elements, long *blocks)
+{
+    long cnt = 0;
+    queue_contex_t *qctx;
+    pthread_rwlock_wrlock(&chain_lock);
+    list_for_each_entry (qctx, &chain.head, chain)
+        cnt += qctx->size;
+    *elements = cnt;
+    *blocks = allocation_check();
+    pthread_rwlock_unlock(&chain_lock);
+}
+
 static void q_init()
 {
     fail_count = 0;
+    thread_ready = true;
     INIT_LIST_HEAD(&chain.head);
     signal(SIGSEGV, sigsegv_handler);
     signal(SIGALRM, sigalrm_handler);
@@ -1132,6 +1600,7 @@ static void q_init()
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
+    pthread_rwlock_wrlock(&chain_lock);
     if (current && current->size > BIG_LIST_SIZE)
         set_cautious_mode(false);
 
@@ -1141,6 +1610,7 @@ static bool q_quit(int argc, char *argv[])
             queue_contex_t *qctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
             q_free(qctx->q);
+            pthread_mutex_destroy(queue_lock(qctx));
             free(qctx);
             chain.size--;
         }
@@ -1148,6 +1618,10 @@ static bool q_quit(int argc, char *argv[])
 
     exception_cancel();
     set_cautious_mode(true);
+    INIT_LIST_HEAD(&chain.head);
+    chain_gen++;
+    pthread_rwlock_unlock(&chain_lock);
+    dudect_set_histfile(NULL);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1161,11 +1635,21 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf(
+        "Usage: %s [-h] [-f IFILE [-p]][-v VLEVEL][-l LFILE][-j JFILE]"
+        "[-c IFILE -o OFILE][-r RFILE]\n",
+        cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-p         Read and parse commands from IFILE in a separate\n"
+           "\t           thread, while earlier ones run\n");
+    printf("\t-c IFILE   Compile commands in IFILE into a binary trace\n");
+    printf("\t-o OFILE   Write the binary trace compiled with -c to OFILE\n");
+    printf("\t-r RFILE   Replay binary trace RFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-j JFILE   Write per-command results to JFILE as JSON lines,\n"
+           "\t           or CSV if JFILE ends in .csv\n");
     exit(0);
 }
 
@@ -1233,10 +1717,14 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char *compile_name = NULL;
+    char *output_name = NULL;
+    char *replay_name = NULL;
+    char *result_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:pl:j:c:o:r:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1246,6 +1734,9 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             infile_name = buf;
             break;
+        case 'p':
+            set_pipelined(true);
+            break;
         case 'v': {
             char *endptr;
             errno = 0;
@@ -1261,6 +1752,18 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'j':
+            result_name = optarg;
+            break;
+        case 'c':
+            compile_name = optarg;
+            break;
+        case 'o':
+            output_name = optarg;
+            break;
+        case 'r':
+            replay_name = optarg;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1268,6 +1771,11 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (compile_name && !output_name) {
+        fprintf(stderr, "Option -c requires an output file given by -o\n");
+        exit(EXIT_FAILURE);
+    }
+
     /* A better seed can be obtained by combining getpid() and its parent ID
      * with the Unix time.
      */
@@ -1277,8 +1785,15 @@ int main(int argc, char *argv[])
     init_cmd();
     console_init();
 
+    /* Compile trace and exit without running any command */
+    if (compile_name) {
+        bool ok = compile_trace(compile_name, output_name);
+        ok = finish_cmd() && ok;
+        return !ok;
+    }
+
     /* Initialize linenoise only when infile_name not exist */
-    if (!infile_name) {
+    if (!infile_name && !replay_name) {
         /* Trigger call back function(auto completion) */
         line_set_completion_callback(completion);
 
@@ -1291,11 +1806,20 @@ int main(int argc, char *argv[])
         set_echo(true);
     if (logfile_name)
         set_logfile(logfile_name);
+    if (result_name && !set_resultfile(result_name)) {
+        fprintf(stderr, "Could not open result file '%s'\n", result_name);
+        exit(EXIT_FAILURE);
+    }
 
     add_quit_helper(q_quit);
+    set_state_func(q_state);
+    set_cmd_lock_func(q_lock_cmd);
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+    if (replay_name)
+        ok = ok && replay_trace(replay_name);
+    else
+        ok = ok && run_console(infile_name);
 
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
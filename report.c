@@ -1,24 +1,37 @@
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
-#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "report.h"
-#include "web.h"
 
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
 
 static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
+static FILE *resultfile = NULL;
+static bool result_csv = false;
+/* Keeps the results of commands run by different threads on lines apart */
+static pthread_mutex_t result_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int verblevel = 0;
+
+/* Output collected for the response to a web request, by each thread
+ * serving requests.
+ */
+static __thread bool capturing = false;
+static __thread char *capture_buf = NULL;
+static __thread size_t capture_len = 0;
+static __thread size_t capture_size = 0;
+
 static void init_files(FILE *efile, FILE *vfile)
 {
     errfile = efile;
@@ -51,6 +64,87 @@ bool set_logfile(char *file_name)
     return logfile != NULL;
 }
 
+bool set_resultfile(char *file_name)
+{
+    resultfile = fopen(file_name, "w");
+    if (!resultfile)
+        return false;
+
+    size_t len = strlen(file_name);
+    result_csv = len >= 4 && strcmp(file_name + len - 4, ".csv") == 0;
+    if (result_csv)
+        fputs("command,args,elapsed_ns,elements,alloc_delta,ok\n", resultfile);
+    return true;
+}
+
+bool resultfile_enabled()
+{
+    return resultfile != NULL;
+}
+
+/* Write s as the contents of a JSON string */
+static void json_escape(FILE *f, const char *s)
+{
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+}
+
+/* Write s inside a quoted CSV field */
+static void csv_escape(FILE *f, const char *s)
+{
+    for (; *s; s++) {
+        if (*s == '"')
+            fputc('"', f);
+        fputc(*s, f);
+    }
+}
+
+void report_result(const cmd_result_t *res)
+{
+    if (!resultfile || res->argc < 1)
+        return;
+
+    pthread_mutex_lock(&result_lock);
+    if (result_csv) {
+        /* Quote command and arguments, doubling embedded quotes */
+        fputc('"', resultfile);
+        csv_escape(resultfile, res->argv[0]);
+        fputs("\",\"", resultfile);
+        for (int i = 1; i < res->argc; i++) {
+            if (i > 1)
+                fputc(' ', resultfile);
+            csv_escape(resultfile, res->argv[i]);
+        }
+        fprintf(resultfile, "\",%lu,%ld,%ld,%d\n",
+                (unsigned long) res->elapsed_ns, res->elements,
+                res->alloc_delta, res->ok ? 1 : 0);
+        pthread_mutex_unlock(&result_lock);
+        return;
+    }
+
+    fputs("{\"cmd\":\"", resultfile);
+    json_escape(resultfile, res->argv[0]);
+    fputs("\",\"args\":[", resultfile);
+    for (int i = 1; i < res->argc; i++) {
+        fputs(i > 1 ? ",\"" : "\"", resultfile);
+        json_escape(resultfile, res->argv[i]);
+        fputc('"', resultfile);
+    }
+    fprintf(resultfile,
+            "],\"elapsed_ns\":%lu,\"elements\":%ld,\"alloc_delta\":%ld,"
+            "\"ok\":%s}\n",
+            (unsigned long) res->elapsed_ns, res->elements, res->alloc_delta,
+            res->ok ? "true" : "false");
+    pthread_mutex_unlock(&result_lock);
+}
+
 void report_event(message_t msg, char *fmt, ...)
 {
     va_list ap;
@@ -95,14 +189,57 @@ void report_event(message_t msg, char *fmt, ...)
     }
 }
 
-#define BUF_SIZE 4096
-extern int web_connfd;
+void report_capture_start(void)
+{
+    capturing = true;
+    capture_len = 0;
+}
+
+const char *report_capture_end(size_t *len)
+{
+    capturing = false;
+    *len = capture_len;
+    return capture_buf;
+}
+
+/* Format straight into the capture buffer, growing it when the text does
+ * not fit.
+ */
+static void capture_vprintf(const char *fmt, va_list ap)
+{
+    va_list aq;
+    va_copy(aq, ap);
+    int n = vsnprintf(capture_buf + capture_len, capture_size - capture_len,
+                      fmt, aq);
+    va_end(aq);
+    if (n < 0)
+        return;
+    if (capture_len + n >= capture_size) {
+        size_t size = MAX(capture_size * 2, capture_len + n + 1);
+        char *buf = realloc(capture_buf, size);
+        if (!buf)
+            return;
+        capture_buf = buf;
+        capture_size = size;
+        vsnprintf(capture_buf + capture_len, capture_size - capture_len, fmt,
+                  ap);
+    }
+    capture_len += n;
+}
+
+void report_capture(char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    capture_vprintf(fmt, ap);
+    va_end(ap);
+}
+
 void report(int level, char *fmt, ...)
 {
     if (!verbfile)
         init_files(stdout, stdout);
 
-    char buffer[BUF_SIZE];
     if (level <= verblevel) {
         va_list ap;
         va_start(ap, fmt);
@@ -118,15 +255,12 @@ void report(int level, char *fmt, ...)
             fflush(logfile);
             va_end(ap);
         }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
-    if (web_connfd) {
-        int len = strlen(buffer);
-        buffer[len] = '\n';
-        buffer[len + 1] = '\0';
-        web_send(web_connfd, buffer);
+        if (capturing) {
+            va_start(ap, fmt);
+            capture_vprintf(fmt, ap);
+            va_end(ap);
+            report_capture("\n");
+        }
     }
 }
 
@@ -135,7 +269,6 @@ void report_noreturn(int level, char *fmt, ...)
     if (!verbfile)
         init_files(stdout, stdout);
 
-    char buffer[BUF_SIZE];
     if (level <= verblevel) {
         va_list ap;
         va_start(ap, fmt);
@@ -149,13 +282,12 @@ void report_noreturn(int level, char *fmt, ...)
             fflush(logfile);
             va_end(ap);
         }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
+        if (capturing) {
+            va_start(ap, fmt);
+            capture_vprintf(fmt, ap);
+            va_end(ap);
+        }
     }
-
-    if (web_connfd)
-        web_send(web_connfd, buffer);
 }
 
 /* Functions denoting failures */
@@ -197,6 +329,29 @@ static size_t peak_bytes = 0;
 static size_t last_peak_bytes = 0;
 static size_t current_bytes = 0;
 
+/* Web worker threads allocate too */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void count_allocate(size_t bytes)
+{
+    pthread_mutex_lock(&heap_lock);
+    allocate_cnt++;
+    allocate_bytes += bytes;
+    current_bytes += bytes;
+    peak_bytes = MAX(peak_bytes, current_bytes);
+    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void count_free(size_t bytes)
+{
+    pthread_mutex_lock(&heap_lock);
+    free_cnt++;
+    free_bytes += bytes;
+    current_bytes -= bytes;
+    pthread_mutex_unlock(&heap_lock);
+}
+
 static void check_exceed(size_t new_bytes)
 {
     size_t limit_bytes = (size_t) mblimit << 20;
@@ -218,11 +373,7 @@ void *malloc_or_fail(size_t bytes, char *fun_name)
         return NULL;
     }
 
-    allocate_cnt++;
-    allocate_bytes += bytes;
-    current_bytes += bytes;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    count_allocate(bytes);
 
     return p;
 }
@@ -237,11 +388,7 @@ void *calloc_or_fail(size_t cnt, size_t bytes, char *fun_name)
         return NULL;
     }
 
-    allocate_cnt++;
-    allocate_bytes += cnt * bytes;
-    current_bytes += cnt * bytes;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    count_allocate(cnt * bytes);
 
     return p;
 }
@@ -257,15 +404,20 @@ char *strsave_or_fail(char *s, char *fun_name)
     if (!ss)
         fail_fun("strsave failed in %s", fun_name);
 
-    allocate_cnt++;
-    allocate_bytes += len + 1;
-    current_bytes += len + 1;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    count_allocate(len + 1);
 
     return strncpy(ss, s, len + 1);
 }
 
+void heap_usage(size_t *current, size_t *peak, size_t *allocs)
+{
+    pthread_mutex_lock(&heap_lock);
+    *current = current_bytes;
+    *peak = peak_bytes;
+    *allocs = allocate_cnt;
+    pthread_mutex_unlock(&heap_lock);
+}
+
 /* Free block, as from malloc, realloc, or strsave */
 void free_block(void *b, size_t bytes)
 {
@@ -273,9 +425,7 @@ void free_block(void *b, size_t bytes)
         report_event(MSG_ERROR, "Attempting to free null block");
     free(b);
 
-    free_cnt++;
-    free_bytes += bytes;
-    current_bytes -= bytes;
+    count_free(bytes);
 }
 
 /* Free array, as from calloc */
@@ -285,9 +435,7 @@ void free_array(void *b, size_t cnt, size_t bytes)
         report_event(MSG_ERROR, "Attempting to free null block");
     free(b);
 
-    free_cnt++;
-    free_bytes += cnt * bytes;
-    current_bytes -= cnt * bytes;
+    count_free(cnt * bytes);
 }
 
 /* Free string saved by strsave_or_fail */
@@ -304,12 +452,32 @@ void init_time(double *timep)
     (void) delta_time(timep);
 }
 
+uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
 double delta_time(double *timep)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double current_time = tv.tv_sec + 1.0E-6 * tv.tv_usec;
+    double current_time = 1.0E-9 * time_ns();
     double delta = current_time - *timep;
     *timep = current_time;
     return delta;
 }
+
+bool start_thread(pthread_t *thread, void *(*fun)(void *), void *arg)
+{
+    /* The thread inherits the mask in effect when it is created */
+    sigset_t mask, old;
+    sigfillset(&mask);
+    sigdelset(&mask, SIGSEGV);
+    sigdelset(&mask, SIGBUS);
+    sigdelset(&mask, SIGFPE);
+    sigdelset(&mask, SIGILL);
+    pthread_sigmask(SIG_SETMASK, &mask, &old);
+    bool started = !pthread_create(thread, NULL, fun, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return started;
+}
@@ -1,8 +1,10 @@
 #ifndef LAB0_REPORT_H
 #define LAB0_REPORT_H
 
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Ways to report interesting behavior and errors */
 
@@ -26,6 +28,40 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* Also collect the output of report and report_noreturn in memory, to be
+ * sent as the response to a web request.
+ */
+void report_capture_start(void);
+
+/* Stop collecting.  Return the output, which is not NUL-terminated and stays
+ * valid until the next report_capture_start.
+ */
+const char *report_capture_end(size_t *len);
+
+/* Append to the captured output only */
+void report_capture(char *fmt, ...);
+
+/* Machine-readable record of one command */
+typedef struct {
+    int argc;
+    char **argv;
+    uint64_t elapsed_ns;
+    long elements;    /* Elements in all queues after the command */
+    long alloc_delta; /* Change in number of allocated blocks */
+    bool ok;
+} cmd_result_t;
+
+/* Write a record per command to file_name.  Use CSV if the name ends in
+ * ".csv", JSON Lines otherwise.
+ */
+bool set_resultfile(char *file_name);
+
+/* Is a result file open? */
+bool resultfile_enabled();
+
+/* Append record to the result file */
+void report_result(const cmd_result_t *res);
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, char *fun_name);
 
@@ -44,10 +80,23 @@ void free_array(void *b, size_t cnt, size_t bytes);
 /* Free string saved by strsave_or_fail */
 void free_string(char *s);
 
+/* Bytes currently and at most allocated by the functions above, and the
+ * number of allocations
+ */
+void heap_usage(size_t *current, size_t *peak, size_t *allocs);
+
+/* Current reading of the monotonic clock in nanoseconds */
+uint64_t time_ns(void);
+
 /* Time counted as fp number in seconds */
 void init_time(double *timep);
 
 /* Compute time since last call with this timer and reset timer */
 double delta_time(double *timep);
 
+/* Start a thread running fun(arg).  Signals other than faults, such as the
+ * alarm of time limits, are left to the calling thread.
+ */
+bool start_thread(pthread_t *thread, void *(*fun)(void *), void *arg);
+
 #endif /* LAB0_REPORT_H */
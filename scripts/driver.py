@@ -4,6 +4,12 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import json
+import os
+import re
+import socket
+import tempfile
+import time
 
 
 
@@ -17,6 +23,7 @@ class Tracer:
     autograde = False
     useValgrind = False
     colored = False
+    tools = False
 
     traceDict = {
         1: "trace-01-ops",
@@ -35,7 +42,16 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-repeat",
+        19: "trace-19-stats",
+        20: "trace-20-counters",
+        21: "trace-21-results",
+        22: "trace-22-replay",
+        23: "trace-23-web",
+        24: "trace-24-nonconst",
+        25: "trace-25-webquit",
+        26: "trace-26-linear"
     }
 
     traceProbs = {
@@ -55,11 +71,85 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23",
+        24: "Trace-24",
+        25: "Trace-25",
+        26: "Trace-26"
     }
 
     maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
 
+    # Traces of the tools around qtest rather than of queue.c.  They are
+    # not graded, and only run with -T or when asked for by -t.
+    toolTraces = [18, 19, 20, 21, 22, 23, 24, 25, 26]
+
+    # Report of the perf command, also when there are no counters
+    perfReport = r"^(  cycles\s+(\d+|not supported)|Hardware performance counters are not available)$"
+
+    # Lines the output of a trace must contain, in this order
+    traceOutput = {
+        19: [r"^Command\s", r"^ih\s+3\s", r"^rh\s+1\s", r"^Command\s",
+             r"^it\s+1\s"],
+        20: [perfReport, perfReport, perfReport],
+        23: [r"^HTTP/1.1 200 OK$", r"^l = \[x\]$", r"^HTTP/1.1 200 OK$",
+             r"^l = \[x y\]$", r"^HTTP/1.1 200 OK$", r"^Removed x",
+             r"^Removed y", r"^l = \[\]$"],
+        24: [r"Testing size", r"ERROR: Probably not constant time"],
+        25: [r"^HTTP/1.1 200 OK$", r"^'quit' is not available",
+             r"^HTTP/1.1 200 OK$", r"^'source' is not available",
+             r"^HTTP/1.1 200 OK$", r"^l = \[x\]$"],
+        26: [r"complexity of %s: %s " % (op, cplx) for (op, cplx) in
+             [("ih", "O\(1\)"), ("it", "O\(1\)"), ("rh", "O\(1\)"),
+              ("rt", "O\(1\)")] +
+             [(op, "O\(n\)") for op in
+              ["size", "dm", "dedup", "swap", "reverse", "reverseK", "ascend",
+               "descend", "merge"]]]
+    }
+
+    # Traces fed to qtest on standard input, followed by 'web', and the
+    # pieces of pipelined requests then sent to the server, some of them
+    # split in the middle.  The responses follow the output of qtest.
+    traceWeb = {
+        23: [b"GET /it/x HTTP/1.1\r\n\r\nGET /it/y HT",
+             b"TP/1.1\r\n\r\nPOST / HTTP/1.1\r\n"
+             b"Content-Length: 10\r\n\r\nrh x\n",
+             b"rh y\n"],
+        25: [b"GET /repeat/1/quit HTTP/1.1\r\n\r\n"
+             b"GET /repeat/2/source/x HTTP/1.1\r\n\r\n"
+             b"GET /it/x HTTP/1.1\r\n\r\n"]
+    }
+
+    # Web traces served by this many worker threads rather than the console
+    traceWebThreads = {25: 2}
+
+    # Traces run with -j, and the command, arguments, elements in all queues
+    # afterwards, change in allocated blocks and success of each command
+    # they must write
+    traceResults = {
+        21: [("#", ["Test", "of", "results", "written", "by", "-j"], 0, 0, True),
+             ("option", ["fail", "0"], 0, 0, True),
+             ("option", ["malloc", "0"], 0, 0, True),
+             ("new", [], 0, 1, True),
+             ("ih", ["a"], 1, 2, True),
+             ("it", ["b"], 2, 2, True),
+             ("reverse", [], 2, 0, True),
+             ("rh", ["b"], 1, -2, True),
+             ("rh", ["a"], 0, -2, True),
+             ("free", [], 0, -1, True)]
+    }
+
+    # Traces compiled with -c, then replayed with -r
+    traceReplay = [22]
+
+    # Traces in which qtest must report an error, checked by their output
+    traceFails = [24, 25]
+
     RED = '\033[91m'
     GREEN = '\033[92m'
     WHITE = '\033[0m'
@@ -69,13 +159,15 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 tools=False):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.tools = tools
 
     def printInColor(self, text, color):
         if self.colored == False:
@@ -90,18 +182,130 @@ class Tracer:
         vname = "%d" % self.verbLevel
         clist = self.command + ["-v", vname, "-f", fname]
 
+        expected = self.traceOutput.get(tid)
+        results = self.traceResults.get(tid)
+        if tid in self.traceReplay:
+            (fd, bname) = tempfile.mkstemp(suffix=".bin")
+            os.close(fd)
+            compiled = subprocess.call([self.qtest, "-c", fname, "-o", bname])
+            clist = self.command + ["-v", vname, "-r", bname]
+            if compiled != 0:
+                self.printInColor("ERROR: Could not compile %s" % fname, self.RED)
+                os.remove(bname)
+                return False
+        if results is not None:
+            (fd, rname) = tempfile.mkstemp(suffix=".json")
+            os.close(fd)
+            clist += ["-j", rname]
         try:
-            retcode = subprocess.call(clist)
+            if tid in self.traceWeb:
+                clist = self.command + ["-v", vname]
+                (output, retcode) = self.runWeb(clist, fname,
+                                                self.traceWeb[tid],
+                                                self.traceWebThreads.get(tid))
+                sys.stdout.write(output)
+            elif expected is None:
+                retcode = subprocess.call(clist)
+            else:
+                proc = subprocess.Popen(clist, stdout=subprocess.PIPE,
+                                        universal_newlines=True)
+                output = proc.communicate()[0]
+                sys.stdout.write(output)
+                retcode = proc.returncode
         except Exception as e:
             self.printInColor("Call of '%s' failed: %s" % (" ".join(clist), e), self.RED)
             return False
-        return retcode == 0
+        if tid in self.traceReplay:
+            os.remove(bname)
+        if retcode is None:
+            return False
+        if expected is not None and not self.checkOutput(output, expected):
+            return False
+        if results is not None:
+            ok = self.checkResults(rname, results)
+            os.remove(rname)
+            if not ok:
+                return False
+        return (retcode != 0) == (tid in self.traceFails)
+
+    def runWeb(self, clist, fname, pieces, threads=None):
+        s = socket.socket()
+        s.bind(("127.0.0.1", 0))
+        port = s.getsockname()[1]
+        s.close()
+        proc = subprocess.Popen(clist, stdin=subprocess.PIPE,
+                                stdout=subprocess.PIPE,
+                                universal_newlines=True)
+        with open(fname) as f:
+            proc.stdin.write(f.read())
+        if threads is None:
+            proc.stdin.write("web %d\n" % port)
+        else:
+            proc.stdin.write("web %d %d\n" % (port, threads))
+        proc.stdin.flush()
+        output = ""
+        while "listen on port" not in output:
+            line = proc.stdout.readline()
+            if not line:
+                break
+            output += line
+
+        responses = b""
+        try:
+            conn = socket.create_connection(("127.0.0.1", port), timeout=5)
+            for piece in pieces:
+                conn.sendall(piece)
+                time.sleep(0.1)
+            conn.shutdown(socket.SHUT_WR)
+            while True:
+                data = conn.recv(65536)
+                if not data:
+                    break
+                responses += data
+            conn.close()
+        finally:
+            try:
+                output += proc.communicate("quit\n", timeout=30)[0]
+            except subprocess.TimeoutExpired:
+                proc.kill()
+                output += proc.communicate()[0]
+                self.printInColor("ERROR: qtest did not quit", self.RED)
+                return (output + responses.decode(), None)
+        return (output + responses.decode(), proc.returncode)
+
+    def checkResults(self, rname, results):
+        try:
+            with open(rname) as f:
+                records = [json.loads(line) for line in f]
+        except ValueError as e:
+            self.printInColor("ERROR: Malformed results: %s" % e, self.RED)
+            return False
+        found = [(r["cmd"], r["args"], r["elements"], r["alloc_delta"], r["ok"])
+                 for r in records]
+        for (want, got) in zip(results, found):
+            if want != got:
+                self.printInColor("ERROR: Result %s, expected %s" % (got, want), self.RED)
+                return False
+        if len(found) != len(results):
+            self.printInColor("ERROR: %d results, expected %d" % (len(found), len(results)), self.RED)
+            return False
+        return True
+
+    def checkOutput(self, output, expected):
+        lines = iter(output.splitlines())
+        for pattern in expected:
+            if not any(re.search(pattern, line) for line in lines):
+                self.printInColor("ERROR: No line matching '%s' in output" % pattern, self.RED)
+                return False
+        return True
 
     def run(self, tid=0):
-        scoreDict = {k: 0 for k in self.traceDict.keys()}
+        scoreDict = {k: 0 for k in self.traceDict.keys()
+                     if k not in self.toolTraces}
         print("---\tTrace\t\tPoints")
         if tid == 0:
-            tidList = self.traceDict.keys()
+            tidList = [t for t in self.traceDict.keys()
+                       if (t in self.toolTraces) == self.tools]
         else:
             if not tid in self.traceDict:
                 self.printInColor("ERROR: Invalid trace ID %d" % tid, self.RED)
@@ -118,7 +322,8 @@ class Tracer:
             if self.verbLevel > 0:
                 print("+++ TESTING trace %s:" % tname)
             ok = self.runTrace(t)
-            maxval = self.maxScores[t]
+            # A tool trace counts one point, outside of the grade
+            maxval = 1 if t in self.toolTraces else self.maxScores[t]
             tval = maxval if ok else 0
             if tval < maxval:
                 self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.RED)
@@ -126,7 +331,8 @@ class Tracer:
                 self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.GREEN)
             score += tval
             maxscore += maxval
-            scoreDict[t] = tval
+            if t in scoreDict:
+                scoreDict[t] = tval
         if score < maxscore:
             self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.RED)
         else:
@@ -146,12 +352,13 @@ class Tracer:
             sys.exit(1)
 
 def usage(name):
-    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c] [-T]" % name)
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
     print("  -c Enable colored text")
+    print("  -T        Test the tools around qtest rather than queue.c")
     sys.exit(0)
 
 
@@ -163,8 +370,9 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    tools = False
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:A:cT', ['valgrind'])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -181,6 +389,8 @@ def run(name, args):
             useValgrind = True
         elif opt == '-c':
             colored = True
+        elif opt == '-T':
+            tools = True
         else:
             print("Unrecognized option '%s'" % opt)
             usage(name)
@@ -190,7 +400,8 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               tools=tools)
     t.run(tid)
 
 
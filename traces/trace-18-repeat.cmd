@@ -0,0 +1,24 @@
+# Test of repeat blocks, nested, timed and profiled
+option fail 0
+option malloc 0
+new
+repeat 2
+  ih a
+  time repeat 2
+    it b
+  end
+  perf repeat 1
+    repeat 2 ih c
+  end
+end
+rh c
+rh c
+rh a
+rh c
+rh c
+rh a
+rt b
+rt b
+rt b
+repeat 1 rt b
+size
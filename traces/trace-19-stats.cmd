@@ -0,0 +1,14 @@
+# Test of per-command latency statistics
+option fail 0
+option malloc 0
+option verbose 1
+option latency 1
+new
+ih a
+ih b
+ih c
+rh c
+stats
+stats reset
+it d
+stats
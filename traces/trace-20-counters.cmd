@@ -0,0 +1,12 @@
+# Test of hardware performance counters around commands and blocks
+option fail 0
+option malloc 0
+option verbose 1
+new
+perf ih a
+perf repeat 3 it b
+perf repeat 2
+  rh
+end
+rh b
+rh b
@@ -0,0 +1,10 @@
+# Test of results written by -j
+option fail 0
+option malloc 0
+new
+ih a
+it b
+reverse
+rh b
+rh a
+free
@@ -0,0 +1,13 @@
+# Test of compiling a trace and replaying it
+option fail 0
+option malloc 0
+new
+ih dolphin
+it gerbil
+repeat 2 ih bear
+reverse
+rh gerbil
+rt bear
+rt bear
+rh dolphin
+free
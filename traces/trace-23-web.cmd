@@ -0,0 +1,5 @@
+# Test of web requests that arrive in pieces
+option fail 0
+option malloc 0
+option verbose 3
+new
@@ -0,0 +1,5 @@
+# Test that the linear q_size is not reported as constant time
+option verbose 1
+option simulation 1
+size
+option simulation 0
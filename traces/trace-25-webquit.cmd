@@ -0,0 +1,5 @@
+# Test of console commands refused to web worker threads, even repeated
+option fail 0
+option malloc 0
+option verbose 3
+new
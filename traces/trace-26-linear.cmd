@@ -0,0 +1,16 @@
+# Test of the complexity estimated for constant and linear operations
+option fail 0
+option malloc 0
+complexity ih 1
+complexity it 1
+complexity rh 1
+complexity rt 1
+complexity size n
+complexity dm n
+complexity dedup n
+complexity swap n
+complexity reverse n
+complexity reverseK n
+complexity ascend n
+complexity descend n
+complexity merge n
@@ -2,18 +2,56 @@
  * MIT License.
  */
 
+/* Needed for accept4 */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <arpa/inet.h> /* inet_ntoa */
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> /* strncasecmp */
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "report.h"
+#include "web.h"
+
 #define LISTENQ 1024 /* second argument to listen() */
-#define MAXLINE 1024 /* max length of a line */
-#define BUFSIZE 1024
+#define BUFSIZE 8192 /* initial size of the request buffer */
+
+/* Max length of a request, body included, which bounds a batch of commands */
+#define MAX_REQUEST (1 << 20)
+
+/* Connections handled per call of web_handle() */
+#define MAX_EVENTS 64
+
+/* Give up on a client that does not read its response for this long */
+#define WRITE_TIMEOUT_MS 5000
+
+/* Upper bound of threads serving clients */
+#define MAX_WORKERS 64
+
+/* Files below the working directory are served under this path */
+#define FILE_PREFIX "files/"
 
 #ifndef DEFAULT_PORT
 #define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
@@ -23,105 +61,149 @@
 #define TCP_CORK TCP_NOPUSH
 #endif
 
-typedef struct {
-    int fd;            /* descriptor for this buf */
-    int count;         /* unread byte in this buf */
-    char *bufptr;      /* next unread byte in this buf */
-    char buf[BUFSIZE]; /* internal buffer */
-} rio_t;
+/* A client that went away must not kill the process with SIGPIPE */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 typedef struct {
     char filename[512];
-    off_t offset; /* for support Range */
-    size_t end;
+    off_t offset; /* for support Range, negative for the last bytes */
+    off_t end;    /* past the last byte of the range, or -1 for the rest */
+    bool range;   /* a Range was asked for */
+    size_t length;   /* Content-Length of the body */
+    bool post;       /* body holds commands to run */
+    bool keep_alive; /* connection stays open after the response */
 } http_request_t;
 
-static void rio_readinitb(rio_t *rp, int fd)
-{
-    rp->fd = fd;
-    rp->count = 0;
-    rp->bufptr = rp->buf;
-}
+/* What the request parser expects next */
+typedef enum {
+    PARSE_REQUEST_LINE,
+    PARSE_HEADERS,
+    PARSE_BODY,
+} parse_state_t;
+
+typedef struct {
+    int fd;              /* client socket */
+    bool binary;         /* speaks the binary protocol instead of HTTP */
+    bool failed;         /* a write failed, so the client is gone */
+    bool once;           /* close after the first response */
+    parse_state_t state; /* parser state for the request at start */
+    http_request_t req;  /* fields parsed so far */
+    size_t start;        /* offset in buf of the first unserved request */
+    size_t pos;          /* offset in buf where parsing resumes */
+    size_t len;          /* bytes held in buf */
+    size_t size;         /* capacity of buf, not counting a spare byte */
+    char *buf;           /* requests received but not served yet */
+} web_conn_t;
+
+static int listen_fd = -1;
+#if defined(__linux__)
+static int epoll_fd = -1;
+#endif
 
-/* This is a wrapper for the Unix read() function that transfers min(n, count)
- * bytes from an internal buffer to a user buffer, where n is the number of
- * bytes requested by the user and count is the number of unread bytes in the
- * internal buffer. On entry, rio_read() refills the internal buffer via a call
- * to read() if the internal buffer is empty.
+/* Listening socket of the binary protocol, its address, the greeting sent
+ * to its clients and the function running their commands
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
-    while (rp->count <= 0) { /* refill if buf is empty */
-        rp->count = read(rp->fd, rp->buf, sizeof(rp->buf));
-        if (rp->count < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
-        } else if (rp->count == 0) { /* EOF */
-            return 0;
-        } else
-            rp->bufptr = rp->buf; /* reset buffer ptr */
-    }
+static int unix_fd = -1;
+static struct sockaddr_un unix_addr;
+static char *unix_hello;
+static size_t unix_hello_len;
+static web_op_func_t op_fun;
 
-    /* Copy min(n, rp->count) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->count < n)
-        cnt = rp->count;
-    memcpy(usrbuf, rp->bufptr, cnt);
-    rp->bufptr += cnt;
-    rp->count -= cnt;
-    return cnt;
-}
+/* Metrics of the program, set by web_open() before any worker starts */
+static web_metrics_func_t metrics_fun;
+
+/* Counters of the server itself, for /metrics.  Worker threads update them
+ * concurrently.
+ */
+#define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, n, __ATOMIC_RELAXED)
+#define STAT_GET(field) \
+    ((unsigned long) __atomic_load_n(&stats.field, __ATOMIC_RELAXED))
+
+static struct {
+    uint64_t accepted; /* connections accepted */
+    uint64_t open;     /* connections open */
+    uint64_t requests; /* requests served */
+    uint64_t received; /* bytes received */
+    uint64_t sent;     /* bytes sent */
+} stats;
 
-static ssize_t writen(int fd, void *usrbuf, size_t n)
+/* Write all of iov, waiting for the client whenever its socket is full.
+ * sendmsg() gathers the pieces like writev(), and can also be told not to
+ * raise SIGPIPE.
+ */
+static ssize_t writevn(int fd, struct iovec *iov, int cnt)
 {
-    size_t nleft = n;
-    char *bufp = usrbuf;
+    size_t n = 0;
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
 
-    while (nleft > 0) {
-        ssize_t nwritten = write(fd, bufp, nleft);
-        if (nwritten <= 0) {
+    while (msg.msg_iovlen > 0) {
+        ssize_t nwritten = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (nwritten < 0) {
             if (errno == EINTR) { /* interrupted by sig handler return */
-                nwritten = 0;     /* and call write() again */
+                nwritten = 0;     /* and call sendmsg() again */
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+                if (poll(&pfd, 1, WRITE_TIMEOUT_MS) <= 0)
+                    return -1;
+                nwritten = 0;
             } else
-                return -1; /* errorno set by write() */
+                return -1; /* errorno set by sendmsg() */
+        }
+        n += nwritten;
+        STAT_ADD(sent, nwritten);
+        /* Skip what was written, which may end inside a piece */
+        while (msg.msg_iovlen > 0 && nwritten >= msg.msg_iov->iov_len) {
+            nwritten -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + nwritten;
+            msg.msg_iov->iov_len -= nwritten;
         }
-        nleft -= nwritten;
-        bufp += nwritten;
     }
     return n;
 }
 
-/* robustly read a text line (buffered) */
-static ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+static void conn_writev(web_conn_t *c, struct iovec *iov, int cnt)
 {
-    char c, *bufp = usrbuf;
+    if (!c->failed && writevn(c->fd, iov, cnt) < 0)
+        c->failed = true;
+}
 
-    int n;
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            break;        /* EOF, some data was read */
-        } else
-            return -1; /* error */
-    }
-    *bufp = 0;
-    return n;
+static void conn_write(web_conn_t *c, const char *buf, size_t n)
+{
+    struct iovec iov = {.iov_base = (void *) buf, .iov_len = n};
+    conn_writev(c, &iov, 1);
 }
 
-void web_send(int out_fd, char *buf)
+static void set_cork(int fd, int on)
 {
-    writen(out_fd, buf, strlen(buf));
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, (const void *) &on, sizeof(int));
 }
 
-int web_open(int port)
+#if defined(__linux__)
+/* All sockets are non-blocking and watched by one epoll instance, whose
+ * descriptor becomes readable whenever any of them is.  A listening socket
+ * is registered with a pointer to the variable holding it, clients with
+ * their web_conn_t.
+ */
+static int web_watch_listener(int fd, int *var)
+{
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+        return -1;
+    if (epoll_fd < 0 && (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return -1;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = var};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return -1;
+    return epoll_fd;
+}
+#endif
+
+int web_open(int port, web_metrics_func_t metrics)
 {
     int listenfd, optval = 1;
     struct sockaddr_in serveraddr;
@@ -153,7 +235,74 @@ int web_open(int port)
     /* Make it a listening socket ready to accept connection requests */
     if (listen(listenfd, LISTENQ) < 0)
         return -1;
+    listen_fd = listenfd;
+    metrics_fun = metrics;
+
+#if defined(__linux__)
+    return web_watch_listener(listenfd, &listen_fd);
+#else
     return listenfd;
+#endif
+}
+
+int web_open_unix(const char *path,
+                  const char *hello,
+                  size_t hello_len,
+                  web_op_func_t run_op)
+{
+#if defined(__linux__)
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    size_t len = strlen(path);
+    if (len >= sizeof(addr.sun_path) || unix_fd >= 0)
+        return -1;
+    memcpy(addr.sun_path, path, len + 1);
+
+    /* A socket left behind by an earlier run would fail bind(), but any
+     * other file at path is not ours to remove.
+     */
+    struct stat st;
+    if (!lstat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            errno = EEXIST;
+            return -1;
+        }
+        unlink(path);
+    }
+
+    unix_hello = malloc(hello_len);
+    if (!unix_hello)
+        return -1;
+    memcpy(unix_hello, hello, hello_len);
+    unix_hello_len = hello_len;
+    op_fun = run_op;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, LISTENQ) < 0) {
+        close(fd);
+        return -1;
+    }
+    unix_addr = addr;
+    unix_fd = fd;
+    return web_watch_listener(fd, &unix_fd);
+#else
+    /* Only served together with the clients of the epoll set */
+    return -1;
+#endif
+}
+
+void web_close_unix(void)
+{
+    if (unix_fd < 0)
+        return;
+    /* Closing the socket also takes it out of the epoll set */
+    close(unix_fd);
+    unix_fd = -1;
+    unlink(unix_addr.sun_path);
+    free(unix_hello);
+    unix_hello = NULL;
 }
 
 static void url_decode(char *src, char *dest, int max)
@@ -161,7 +310,7 @@ static void url_decode(char *src, char *dest, int max)
     char *p = src;
     char code[3] = {0};
     while (*p && --max) {
-        if (*p == '%') {
+        if (*p == '%' && p[1] && p[2]) {
             memcpy(code, ++p, 2);
             *dest++ = (char) strtoul(code, NULL, 16);
             p += 2;
@@ -172,59 +321,641 @@ static void url_decode(char *src, char *dest, int max)
     *dest = '\0';
 }
 
-static void parse_request(int fd, http_request_t *req)
+static void request_init(web_conn_t *c)
 {
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
+    http_request_t *req = &c->req;
+    req->filename[0] = '\0';
     req->offset = 0;
-    req->end = 0; /* default */
-
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%lu", (unsigned long *) &req->offset,
-                   (unsigned long *) &req->end);
-            /* Range: [start, end] */
-            if (req->end != 0)
-                req->end++;
-        }
+    req->end = -1; /* default */
+    req->range = false;
+    req->length = 0;
+    req->post = false;
+    req->keep_alive = false;
+    c->state = PARSE_REQUEST_LINE;
+    c->pos = c->start;
+}
+
+/* Cut the word at *s off with a NUL and move *s to the next word */
+static char *next_word(char **s)
+{
+    char *word = *s;
+    char *end = strchr(word, ' ');
+    if (end) {
+        *end++ = '\0';
+        while (*end == ' ')
+            end++;
+    } else {
+        end = word + strlen(word);
     }
+    *s = end;
+    return word;
+}
+
+static void parse_request_line(http_request_t *req, char *line)
+{
+    char *method = next_word(&line);
+    char *uri = next_word(&line);
+    char *version = next_word(&line);
+    req->post = !strcmp(method, "POST");
+    /* HTTP/1.1 keeps the connection by default, older versions do not */
+    req->keep_alive = !strcmp(version, "HTTP/1.1");
+
     char *filename = uri;
     if (uri[0] == '/') {
         filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
+        if (!*filename) {
             filename = ".";
         } else {
-            for (int i = 0; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
-                }
+            char *query = strchr(filename, '?');
+            if (query)
+                *query = '\0';
+        }
+    }
+    url_decode(filename, req->filename, sizeof(req->filename));
+}
+
+static void parse_header(http_request_t *req, char *line)
+{
+    char *value = strchr(line, ':');
+    if (!value)
+        return;
+    *value++ = '\0';
+    while (*value == ' ' || *value == '\t')
+        value++;
+
+    if (!strcasecmp(line, "Content-Length")) {
+        req->length = strtoul(value, NULL, 10);
+    } else if (!strcasecmp(line, "Connection")) {
+        if (!strncasecmp(value, "close", 5))
+            req->keep_alive = false;
+        else if (!strncasecmp(value, "keep-alive", 10))
+            req->keep_alive = true;
+    } else if (!strcasecmp(line, "Range") && !strncmp(value, "bytes=", 6)) {
+        char *p = value + 6, *end;
+        if (*p == '-') {
+            /* bytes=-n, the last n bytes, as a negative offset */
+            long long n = strtoll(p + 1, &end, 10);
+            if (end == p + 1 || n < 0)
+                return;
+            req->offset = -n;
+            if (!n) /* nothing of the file, which cannot be satisfied */
+                req->end = 0;
+        } else {
+            /* bytes=first-[last], both inclusive */
+            req->offset = strtoll(p, &end, 10);
+            if (end == p || req->offset < 0 || *end != '-')
+                return;
+            p = end + 1;
+            if (*p) {
+                long long last = strtoll(p, &end, 10);
+                /* An invalid range is ignored, as if it were not sent */
+                if (end == p || last < req->offset)
+                    return;
+                /* strtoll() saturates, past any file there is */
+                req->end = last < LLONG_MAX ? last + 1 : LLONG_MAX;
             }
         }
+        req->range = true;
     }
-    url_decode(filename, req->filename, MAXLINE);
 }
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr)
+/* Parse the lines of the first unserved request that have arrived since the
+ * last call, each exactly once.  Return true when the whole request, body
+ * included, is in the buffer; c->pos is then the offset of the body.
+ */
+static bool parse_request(web_conn_t *c)
 {
-    http_request_t req;
-    parse_request(fd, &req);
+    while (c->state != PARSE_BODY) {
+        char *line = c->buf + c->pos;
+        char *eol = memchr(line, '\n', c->len - c->pos);
+        if (!eol)
+            return false;
+        c->pos = eol + 1 - c->buf;
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+        *eol = '\0';
+
+        if (c->state == PARSE_HEADERS) {
+            if (eol == line)
+                c->state = PARSE_BODY;
+            else
+                parse_header(&c->req, line);
+        } else if (eol > line) { /* empty lines before a request are ignored */
+            parse_request_line(&c->req, line);
+            c->state = PARSE_HEADERS;
+        }
+    }
+    return c->len - c->pos >= c->req.length;
+}
 
-    char *p = req.filename;
-    /* Change '/' to ' ' */
-    while (*p) {
-        ++p;
-        if (*p == '/')
-            *p = ' ';
+/* Run each line of a POST body as a command, in order.  The body is
+ * followed by at least one byte of the buffer, which ends the last line
+ * while it runs.
+ */
+static void run_batch(char *body, size_t len, web_cmd_func_t run)
+{
+    char *end = body + len;
+    while (body < end) {
+        char *eol = memchr(body, '\n', end - body);
+        if (!eol)
+            eol = end;
+        char *next = eol + 1;
+        if (eol > body && eol[-1] == '\r')
+            eol--;
+        char saved = *eol;
+        *eol = '\0';
+        if (eol > body)
+            run(body);
+        *eol = saved;
+        body = next;
     }
-    char *ret = malloc(strlen(req.filename) + 1);
-    strncpy(ret, req.filename, strlen(req.filename) + 1);
+}
 
-    return ret;
+static void server_metrics(void)
+{
+    report_capture("# HELP qtest_web_connections_accepted_total Connections "
+                   "accepted.\n"
+                   "# TYPE qtest_web_connections_accepted_total counter\n"
+                   "qtest_web_connections_accepted_total %lu\n"
+                   "# HELP qtest_web_connections Connections open.\n"
+                   "# TYPE qtest_web_connections gauge\n"
+                   "qtest_web_connections %lu\n"
+                   "# HELP qtest_web_requests_total Requests served.\n"
+                   "# TYPE qtest_web_requests_total counter\n"
+                   "qtest_web_requests_total %lu\n"
+                   "# HELP qtest_web_received_bytes_total Bytes received.\n"
+                   "# TYPE qtest_web_received_bytes_total counter\n"
+                   "qtest_web_received_bytes_total %lu\n"
+                   "# HELP qtest_web_sent_bytes_total Bytes sent.\n"
+                   "# TYPE qtest_web_sent_bytes_total counter\n"
+                   "qtest_web_sent_bytes_total %lu\n",
+                   STAT_GET(accepted), STAT_GET(open), STAT_GET(requests),
+                   STAT_GET(received), STAT_GET(sent));
+}
+
+/* Send count bytes of file in from offset, waiting for the client like
+ * writevn().  Linux copies them to the socket in the kernel.
+ */
+static ssize_t sendfilen(int fd, int in, off_t offset, size_t count)
+{
+    size_t n = 0;
+#if defined(__linux__)
+    /* Unlike sendmsg(), sendfile() cannot be told not to raise SIGPIPE, so
+     * block it meanwhile and discard it if it was raised.
+     */
+    sigset_t pipe_set, old;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old);
+    while (n < count) {
+        ssize_t nsent = sendfile(fd, in, &offset, count - n);
+        if (nsent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+            if (poll(&pfd, 1, WRITE_TIMEOUT_MS) > 0)
+                continue;
+        } else if (nsent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nsent <= 0) { /* error, or file shrunk */
+            n = -1;
+            break;
+        }
+        n += nsent;
+        STAT_ADD(sent, nsent);
+    }
+    if (n == (size_t) -1 && errno == EPIPE) {
+        struct timespec zero = {0, 0};
+        sigtimedwait(&pipe_set, NULL, &zero);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return n;
+#else
+    char buf[BUFSIZE];
+    while (n < count) {
+        size_t len = count - n < sizeof(buf) ? count - n : sizeof(buf);
+        ssize_t nread = pread(in, buf, len, offset + n);
+        if (nread <= 0)
+            return -1;
+        struct iovec iov = {.iov_base = buf, .iov_len = nread};
+        if (writevn(fd, &iov, 1) < 0)
+            return -1;
+        n += nread;
+    }
+    return n;
+#endif
 }
+
+static const char *file_type(const char *path)
+{
+    static const struct {
+        const char *ext, *type;
+    } types[] = {
+        {".cmd", "text/plain"},       {".txt", "text/plain"},
+        {".log", "text/plain"},       {".csv", "text/csv"},
+        {".html", "text/html"},       {".json", "application/json"},
+    };
+    const char *ext = strrchr(path, '.');
+    for (size_t i = 0; ext && i < sizeof(types) / sizeof(types[0]); i++) {
+        if (!strcmp(ext, types[i].ext))
+            return types[i].type;
+    }
+    return "application/octet-stream";
+}
+
+/* Only plain paths below the working directory, without hidden parts, may
+ * be served.
+ */
+static bool file_allowed(const char *path)
+{
+    for (const char *p = path;; p++) {
+        if (*p == '\0' || *p == '.' || *p == '/')
+            return false;
+        p = strchr(p, '/');
+        if (!p)
+            return true;
+    }
+}
+
+/* Send the file named by the path after FILE_PREFIX, or the range of it
+ * asked for.  Return true if the connection stays open.
+ */
+static bool serve_file(web_conn_t *c, http_request_t *req)
+{
+    const char *path = req->filename + strlen(FILE_PREFIX);
+    const char *conn = req->keep_alive ? "keep-alive" : "close";
+    char header[512];
+    int n;
+    STAT_ADD(requests, 1);
+
+    struct stat st;
+    int fd = file_allowed(path) ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+                     "Connection: %s\r\n\r\n",
+                     conn);
+        conn_write(c, header, n);
+        if (fd >= 0)
+            close(fd);
+        return req->keep_alive && !c->failed;
+    }
+
+    off_t size = st.st_size;
+    off_t start = 0, end = size;
+    if (req->range) {
+        start = req->offset < 0 ? size + req->offset : req->offset;
+        if (start < 0)
+            start = 0;
+        if (req->end >= 0 && req->end < size)
+            end = req->end;
+    }
+    if (req->range && start >= end) {
+        n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                     "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n"
+                     "Connection: %s\r\n\r\n",
+                     (long long) size, conn);
+        conn_write(c, header, n);
+        close(fd);
+        return req->keep_alive && !c->failed;
+    }
+
+    if (req->range)
+        n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 206 Partial Content\r\nContent-Type: %s\r\n"
+                     "Content-Range: bytes %lld-%lld/%lld\r\n"
+                     "Content-Length: %lld\r\nConnection: %s\r\n\r\n",
+                     file_type(path), (long long) start, (long long) end - 1,
+                     (long long) size, (long long) (end - start), conn);
+    else
+        n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+                     "Accept-Ranges: bytes\r\nContent-Length: %lld\r\n"
+                     "Connection: %s\r\n\r\n",
+                     file_type(path), (long long) size, conn);
+    /* The cork holds the header back until the file follows it */
+    conn_write(c, header, n);
+    if (!c->failed && sendfilen(c->fd, fd, start, end - start) < 0)
+        c->failed = true;
+    close(fd);
+    return req->keep_alive && !c->failed;
+}
+
+/* Run the command named by the request path, or the commands in the body of
+ * a POST, and send their output as the response.  /metrics is answered with
+ * the metrics instead.  Return true if the connection stays open.
+ */
+static bool serve_request(web_conn_t *c,
+                          http_request_t *req,
+                          char *body,
+                          web_cmd_func_t run)
+{
+    if (!req->post &&
+        !strncmp(req->filename, FILE_PREFIX, strlen(FILE_PREFIX)))
+        return serve_file(c, req);
+
+    bool metrics = !req->post && !strcmp(req->filename, "metrics");
+    STAT_ADD(requests, 1);
+    report_capture_start();
+    if (metrics) {
+        if (metrics_fun)
+            metrics_fun();
+        server_metrics();
+    } else if (req->post) {
+        run_batch(body, req->length, run);
+    } else {
+        char *p = req->filename;
+        /* Change '/' to ' ' */
+        while (*p) {
+            ++p;
+            if (*p == '/')
+                *p = ' ';
+        }
+        run(req->filename);
+    }
+    size_t len;
+    const char *output = report_capture_end(&len);
+
+    char header[128];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\nContent-Type: text/plain%s\r\n"
+                     "Content-Length: %zu\r\nConnection: %s\r\n\r\n",
+                     metrics ? "; version=0.0.4" : "", len,
+                     req->keep_alive ? "keep-alive" : "close");
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = n},
+        {.iov_base = (void *) output, .iov_len = len},
+    };
+    conn_writev(c, iov, 2);
+    return req->keep_alive && !c->failed;
+}
+
+/* Serve every complete request in the buffer, in the order received.
+ * Return true if the connection stays open.
+ */
+static bool serve_buffered(web_conn_t *c, web_cmd_func_t run)
+{
+    bool served = false;
+    while (parse_request(c)) {
+        if (c->once)
+            c->req.keep_alive = false;
+        if (!serve_request(c, &c->req, c->buf + c->pos, run))
+            return false;
+        c->start = c->pos + c->req.length;
+        request_init(c);
+        served = true;
+    }
+    /* The cork packs the responses to pipelined requests into full
+     * segments.  Push out the rest once no more requests are pending.
+     */
+    if (served) {
+        set_cork(c->fd, 0);
+        set_cork(c->fd, 1);
+    }
+
+    /* Reject a header block or body that cannot fit in the buffer */
+    bool too_large = c->state == PARSE_BODY
+                         ? c->req.length > MAX_REQUEST - (c->pos - c->start)
+                         : c->len - c->start >= MAX_REQUEST;
+    if (!too_large)
+        return true;
+
+    const char *msg = "HTTP/1.1 413 Payload Too Large\r\n"
+                      "Connection: close\r\n\r\n";
+    conn_write(c, msg, strlen(msg));
+    return false;
+}
+
+/* Binary protocol.
+ *
+ * A client of the Unix domain socket is first sent the greeting given to
+ * web_open_unix().  It then sends records, each being uint16_t opcode,
+ * uint16_t argc, uint32_t size and size bytes of arguments, which are passed
+ * on to op_fun as they are.  Each record is answered with uint32_t result,
+ * 1 if the command succeeded, uint32_t size and size bytes of output.  All
+ * integers are in native byte order.
+ */
+#define RECORD_HEADER 8
+
+/* Serve every complete record in the buffer, in the order received.
+ * Return true if the connection stays open.
+ */
+static bool serve_records(web_conn_t *c)
+{
+    while (c->len - c->start >= RECORD_HEADER) {
+        char *rec = c->buf + c->start;
+        uint16_t op, argc;
+        uint32_t size;
+        memcpy(&op, rec, sizeof(op));
+        memcpy(&argc, rec + 2, sizeof(argc));
+        memcpy(&size, rec + 4, sizeof(size));
+        /* Also keeps the buffer from growing past MAX_REQUEST */
+        if (size > MAX_REQUEST - RECORD_HEADER)
+            return false;
+        if (c->len - c->start - RECORD_HEADER < size)
+            break;
+
+        STAT_ADD(requests, 1);
+        report_capture_start();
+        uint32_t ok = op_fun(op, argc, rec + RECORD_HEADER, size);
+        size_t len;
+        const char *output = report_capture_end(&len);
+
+        uint32_t reply[2] = {ok, len};
+        struct iovec iov[2] = {
+            {.iov_base = reply, .iov_len = sizeof(reply)},
+            {.iov_base = (void *) output, .iov_len = len},
+        };
+        conn_writev(c, iov, 2);
+        if (c->failed)
+            return false;
+        c->start += RECORD_HEADER + size;
+    }
+    return true;
+}
+
+/* Read what the client sent and serve it.  Return true if the connection
+ * stays open.
+ */
+static bool conn_handle(web_conn_t *c, web_cmd_func_t run)
+{
+    for (;;) {
+        /* Move the unserved requests to the front before reading more */
+        if (c->start) {
+            c->len -= c->start;
+            c->pos -= c->start;
+            memmove(c->buf, c->buf + c->start, c->len);
+            c->start = 0;
+        }
+        if (c->len == c->size) {
+            /* Only grows while less than MAX_REQUEST is buffered */
+            size_t size = c->size * 2;
+            char *buf = realloc(c->buf, size + 1);
+            if (!buf)
+                return false;
+            c->buf = buf;
+            c->size = size;
+        }
+        ssize_t n = read(c->fd, c->buf + c->len, c->size - c->len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (n == 0) /* EOF */
+            return false;
+        c->len += n;
+        STAT_ADD(received, n);
+        if (!(c->binary ? serve_records(c) : serve_buffered(c, run)))
+            return false;
+    }
+}
+
+static void conn_close(web_conn_t *c)
+{
+    close(c->fd); /* also removes it from the epoll set */
+    free(c->buf);
+    free(c);
+    STAT_ADD(open, -1);
+}
+
+static web_conn_t *conn_new(int fd, bool binary)
+{
+    web_conn_t *c = malloc(sizeof(web_conn_t));
+    char *buf = malloc(BUFSIZE + 1);
+    if (!c || !buf) {
+        free(c);
+        free(buf);
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    c->binary = binary;
+    c->failed = false;
+    c->once = false;
+    c->start = 0;
+    c->len = 0;
+    c->size = BUFSIZE;
+    c->buf = buf;
+    request_init(c);
+    if (!binary)
+        set_cork(fd, 1);
+    STAT_ADD(accepted, 1);
+    STAT_ADD(open, 1);
+    return c;
+}
+
+#if defined(__linux__)
+/* Epoll sets of the threads serving clients.  A client belongs to one
+ * thread for as long as it stays connected.
+ */
+static int worker_fds[MAX_WORKERS];
+static int n_workers = 0;
+static int next_worker = 0;
+static web_cmd_func_t worker_run_fun;
+
+/* Clients of the binary protocol are served by the console thread, which
+ * saves handing their records over to another thread.
+ */
+static void web_accept(int listenfd)
+{
+    bool binary = listenfd == unix_fd;
+    int fd;
+    while ((fd = accept4(listenfd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        web_conn_t *c = conn_new(fd, binary);
+        if (!c)
+            continue;
+        if (binary) {
+            conn_write(c, unix_hello, unix_hello_len);
+            if (c->failed) {
+                conn_close(c);
+                continue;
+            }
+        }
+        int epfd = epoll_fd;
+        if (n_workers && !binary) {
+            epfd = worker_fds[next_worker];
+            next_worker = (next_worker + 1) % n_workers;
+        }
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            conn_close(c);
+    }
+}
+
+static void *worker_loop(void *arg)
+{
+    int epfd = (int) (intptr_t) arg;
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            web_conn_t *c = events[i].data.ptr;
+            if (!conn_handle(c, worker_run_fun))
+                conn_close(c);
+        }
+    }
+    return NULL;
+}
+
+bool web_start_workers(int n, web_cmd_func_t run)
+{
+    if (listen_fd < 0 || n_workers)
+        return false;
+    if (n > MAX_WORKERS)
+        n = MAX_WORKERS;
+    worker_run_fun = run;
+
+    int started = 0;
+    for (int i = 0; i < n; i++) {
+        int epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0)
+            break;
+        pthread_t thread;
+        if (!start_thread(&thread, worker_loop, (void *) (intptr_t) epfd)) {
+            close(epfd);
+            break;
+        }
+        pthread_detach(thread);
+        worker_fds[started++] = epfd;
+    }
+
+    n_workers = started;
+    return started > 0;
+}
+
+void web_handle(web_cmd_func_t run)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 0);
+    for (int i = 0; i < n; i++) {
+        void *p = events[i].data.ptr;
+        if (p == &listen_fd || p == &unix_fd)
+            web_accept(*(int *) p);
+        else if (!conn_handle(p, run))
+            conn_close(p);
+    }
+}
+#else
+/* Without epoll, the console waits on the listening socket, and each
+ * connection is served one request and closed.
+ */
+void web_handle(web_cmd_func_t run)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    web_conn_t *c = conn_new(fd, false);
+    if (!c)
+        return;
+    c->once = true;
+    conn_handle(c, run);
+    conn_close(c);
+}
+
+bool web_start_workers(int n, web_cmd_func_t run)
+{
+    return false;
+}
+#endif
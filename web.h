@@ -1,12 +1,50 @@
 #ifndef TINYWEB_H
 #define TINYWEB_H
 
-#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
 
-int web_open(int port);
+/* Runs one command line received by the server */
+typedef bool (*web_cmd_func_t)(char *cmdline);
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr);
+/* Appends the metrics of the program with report_capture() */
+typedef void (*web_metrics_func_t)(void);
 
-void web_send(int out_fd, char *buffer);
+/* Runs command op of the binary protocol, whose argc - 1 arguments are held
+ * null-terminated in the size bytes at args
+ */
+typedef bool (*web_op_func_t)(unsigned op, int argc, char *args, size_t size);
+
+/* Listen on port.  Return a descriptor that is readable whenever
+ * web_handle() has work to do, or -1 on error.  GET /metrics is answered
+ * with the output of metrics, followed by those of the server, from
+ * whichever thread serves the client.
+ */
+int web_open(int port, web_metrics_func_t metrics);
+
+/* Also listen on the Unix domain socket at path, for local clients of the
+ * compact binary protocol described in web.c.  Each client is first sent
+ * hello, and its records are run by run_op.  Return like web_open(), the
+ * clients being served by web_handle() as well.  Needs epoll.
+ */
+int web_open_unix(const char *path,
+                  const char *hello,
+                  size_t hello_len,
+                  web_op_func_t run_op);
+
+/* Stop listening on the Unix domain socket, and remove it */
+void web_close_unix(void);
+
+/* Accept new clients and serve the requests that have arrived, without
+ * blocking on clients that are not ready.
+ */
+void web_handle(web_cmd_func_t run);
+
+/* Serve clients from n threads, each of which calls run for the clients it
+ * is given.  web_handle() then only accepts clients and hands them to the
+ * threads in turn.  Return false if no thread could be started, which is
+ * always the case without epoll.
+ */
+bool web_start_workers(int n, web_cmd_func_t run);
 
 #endif